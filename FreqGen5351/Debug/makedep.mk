@@ -18,9 +18,15 @@
 
 ..\..\TARL\USI_TWI_Master.c
 
+button.c
+
+diag.c
+
 io.c
 
 main.c
 
 nvram.c
 
+trace.c
+
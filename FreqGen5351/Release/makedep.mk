@@ -20,9 +20,15 @@
 
 ..\..\TARL\si5351a.c
 
+button.c
+
+diag.c
+
 io.c
 
 main.c
 
 nvram.c
 
+trace.c
+
@@ -0,0 +1,34 @@
+################################################################################
+# Automatically-generated file. Do not edit or delete the file
+################################################################################
+
+..\..\TARL\display.c
+
+..\..\TARL\eeprom.c
+
+..\..\TARL\i2c.c
+
+..\..\TARL\lcd.c
+
+..\..\TARL\lcd_i2c.c
+
+..\..\TARL\millis.c
+
+..\..\TARL\pushbutton.c
+
+..\..\TARL\rotary.c
+
+..\..\TARL\si5351a.c
+
+button.c
+
+diag.c
+
+io.c
+
+main.c
+
+nvram.c
+
+trace.c
+
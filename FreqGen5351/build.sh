@@ -1,4 +1,45 @@
 #!/bin/sh
-./convert.sh Release
-cd Release
-make all
+# Build the standard firmware plus the frequency generator only,
+# VFO only, ATtiny817 and ATtiny1617 firmware, then report the size
+# of each
+
+# Only build for the devices the installed avr-gcc can target. The
+# ATtiny 1-series needs avr-gcc 8 or later, or the ATtiny device pack.
+CONFIGS=""
+for config in Release ReleaseFG ReleaseVFO Release817 Release1617
+do
+    mcu=$(grep -o 'mmcu=[a-z0-9]*' $config/Makefile | head -1)
+    if echo 'int main(void){return 0;}' | avr-gcc -$mcu -x c -o /dev/null - 2>/dev/null
+    then
+        CONFIGS="$CONFIGS $config"
+    else
+        echo "Skipping $config: avr-gcc cannot build for ${mcu#mmcu=}"
+    fi
+done
+
+if [ -z "$CONFIGS" ]; then
+    echo 'Error: nothing to build'
+    exit 1
+fi
+
+for config in $CONFIGS
+do
+    ./convert.sh $config
+    (cd $config && make all) || exit 1
+done
+
+echo ''
+echo 'Size report (flash used is text + data):'
+for config in $CONFIGS
+do
+    echo $config
+    avr-size $config/FreqGen5351.elf
+done
+
+echo ''
+echo 'RAM report:'
+for config in $CONFIGS
+do
+    ./memreport.sh $config
+    echo ''
+done
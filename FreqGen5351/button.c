@@ -0,0 +1,117 @@
+/*
+ * button.c
+ *
+ * Debounces the rotary control's push switch and recognises
+ * short press, long press and double click gestures.
+ *
+ * The switch is sampled once per millisecond tick into an
+ * integrator which counts up while the switch reads closed and
+ * down while it reads open. An edge is confirmed when the
+ * integrator reaches either end so a clean press or release is
+ * seen within BUTTON_DEBOUNCE_SAMPLES ms but contact bounce has
+ * to settle first.
+ *
+ * Created: 18/10/2026
+ */ 
+
+#include <inttypes.h>
+
+#include "config.h"
+#include "io.h"
+#include "millis.h"
+#include "button.h"
+
+// Debounce integrator and the confirmed switch state
+static uint8_t integrator;
+static bool bPressed;
+
+// Low byte of the millisecond tick when the switch was last sampled
+static uint8_t lastSampleTime;
+
+// Time the current press started and the last short press finished
+static uint32_t pressTime;
+static uint32_t clickTime;
+
+// Set if the last release was a short press so the next press
+// may be a double click
+static bool bClicked;
+
+// Set if the current press started soon enough after a short
+// press to be a double click
+static bool bDoubleClick;
+
+// Set once the current press has been used so its release is ignored
+static bool bUsed;
+
+bool buttonRead( enum eButtonEvent *pEvent )
+{
+    uint32_t currentTime = millis();
+    bool bA, bB, bSw;
+
+    *pEvent = buttonNone;
+
+    if( (uint8_t) currentTime != lastSampleTime )
+    {
+        lastSampleTime = currentTime;
+
+        // The rotary library reads the encoder, we only want the switch
+        ioReadRotary( &bA, &bB, &bSw );
+
+        if( bSw )
+        {
+            if( integrator < BUTTON_DEBOUNCE_SAMPLES )
+            {
+                integrator++;
+            }
+        }
+        else if( integrator > 0 )
+        {
+            integrator--;
+        }
+
+        if( !bPressed && (integrator == BUTTON_DEBOUNCE_SAMPLES) )
+        {
+            bPressed = true;
+            bUsed = false;
+            bDoubleClick = bClicked && ((currentTime - clickTime) < BUTTON_DOUBLE_CLICK_TIME);
+            pressTime = currentTime;
+        }
+        else if( bPressed && (integrator == 0) )
+        {
+            bPressed = false;
+
+            // A short press is reported on release so it can be told
+            // apart from a long press. After a double click the next
+            // click starts again.
+            bClicked = false;
+            if( !bUsed )
+            {
+                if( bDoubleClick )
+                {
+                    *pEvent = buttonDoubleClick;
+                }
+                else
+                {
+                    *pEvent = buttonShortPress;
+                    bClicked = true;
+                    clickTime = currentTime;
+                }
+            }
+        }
+    }
+
+    // A long press is reported as soon as the time is up rather
+    // than waiting for the release
+    if( bPressed && !bUsed && ((currentTime - pressTime) >= ROTARY_LONG_PRESS_TIME) )
+    {
+        *pEvent = buttonLongPress;
+        bUsed = true;
+    }
+
+    return bPressed && !bUsed;
+}
+
+void buttonCancel()
+{
+    bUsed = true;
+}
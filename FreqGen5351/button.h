@@ -0,0 +1,29 @@
+/*
+ * button.h
+ *
+ * Created: 18/10/2026
+ */ 
+ 
+#ifndef BUTTON_H
+#define BUTTON_H
+
+// Gestures recognised on the rotary control's push switch
+enum eButtonEvent
+{
+    buttonNone,
+    buttonShortPress,
+    buttonLongPress,
+    buttonDoubleClick
+};
+
+// Poll the push switch and return any new gesture in *pEvent.
+// Returns true while the switch is held and the press hasn't
+// yet been used for a gesture.
+bool buttonRead( enum eButtonEvent *pEvent );
+
+// The current press has been used for something else e.g. the
+// rotary control was turned while it was held so don't generate
+// an event when it is released
+void buttonCancel();
+
+#endif //BUTTON_H
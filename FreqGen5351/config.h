@@ -26,13 +26,26 @@ typedef uint8_t bool;
 // here we assume 3kHz.
 #define SSB_OFFSET 1500
 
+// The firmware can be built for only one mode by defining FG_ONLY or
+// VFO_ONLY (see the ReleaseFG and ReleaseVFO build configurations).
+// The mode is then a constant so the code for the other mode is removed.
+#if defined(FG_ONLY) && defined(VFO_ONLY)
+#error "Define only one of FG_ONLY and VFO_ONLY"
+#elif defined(FG_ONLY)
+#define FIXED_VFO_MODE false
+#elif defined(VFO_ONLY)
+#define FIXED_VFO_MODE true
+#endif
+
 #ifdef VPORTC
 
 // ATtiny 1-series
 
 // Processor definitions
 // CPU clock speed
-#define F_CPU 3333333UL
+// ioInit() divides the 20MHz oscillator by 2. This is fast enough for
+// the TWI to run at 400kHz and is within spec down to 2.7V.
+#define F_CPU 10000000UL
 
 // I/O definitions
 
@@ -61,6 +74,119 @@ typedef uint8_t bool;
 #define ROTARY_ENCODER_SW_PIN       1
 #define ROTARY_ENCODER_SW_PIN_CTRL  PORTC.PIN1CTRL
 
+// PTT input - pulled low when transmitting
+#define PTT_DIR_REG     VPORTA.DIR
+#define PTT_IN_REG      VPORTA.IN
+#define PTT_PIN         4
+#define PTT_PIN_CTRL    PORTA.PIN4CTRL
+
+// Frequency counter input and the reference input.
+// The reference input must be connected to the Si5351's
+// COUNTER_REF_CLOCK output.
+#define COUNTER_IN_DIR_REG      VPORTA.DIR
+#define COUNTER_IN_PIN          5
+#define COUNTER_IN_PIN_CTRL     PORTA.PIN5CTRL
+#define COUNTER_IN_EVENT        EVSYS_ASYNCCH0_PORTA_PIN5_gc
+#define COUNTER_REF_DIR_REG     VPORTA.DIR
+#define COUNTER_REF_PIN         6
+#define COUNTER_REF_PIN_CTRL    PORTA.PIN6CTRL
+#define COUNTER_REF_EVENT       EVSYS_ASYNCCH0_PORTA_PIN6_gc
+
+// Serial output for the trace dump on USART0 TXD
+#define SERIAL_TX_DIR_REG   VPORTB.DIR
+#define SERIAL_TX_OUT_REG   VPORTB.OUT
+#define SERIAL_TX_PIN       2
+#define SERIAL_BAUD_RATE    115200
+
+// Receiver detector or squelch voltage for the memory scanner
+#define DETECTOR_PIN_CTRL   PORTA.PIN7CTRL
+#define DETECTOR_MUXPOS     ADC_MUXPOS_AIN7_gc
+
+// Features that don't fit in 8K of flash and 512 bytes of RAM.
+// The ATtiny817 has no more than the ATtiny85 so these are only built
+// for the pin compatible ATtiny1617 and ATtiny3217 (Release1617).
+#if PROGMEM_SIZE > 8192
+
+// RIT, XIT and split operation in VFO mode
+#define ENABLE_RIT
+
+// Reciprocal frequency counter
+#define ENABLE_COUNTER
+
+// Crystal calibration against a reference on the counter input
+#define ENABLE_CALIBRATION
+
+// Fast push switch debounce with double click and press-and-turn
+#define ENABLE_GESTURES
+
+// Band display and band stacking registers in VFO mode.
+// Needs ENABLE_POWER_FAIL_SAVE to save them.
+#define ENABLE_BAND_STACK
+
+// Restore the outputs straight away after a reset that wasn't a power on
+#define ENABLE_WARM_RESTART
+
+// Save the state to the user row and the band stacking registers
+// to the EEPROM when the supply starts to fail.
+// Needs the BOD enabled in the fuses.
+#define ENABLE_POWER_FAIL_SAVE
+
+// Supply level that triggers the save, above the BOD level
+#define POWER_FAIL_VLM_LEVEL BOD_VLMLVL_25ABOVE_gc
+
+// Keep the setting last written to each clock and don't write it
+// again if it hasn't changed. 15 bytes of RAM.
+#define ENABLE_OSC_CACHE
+
+// Loop time, bus and rotary control counters shown on a page after
+// the frequency counter or, in VFO mode, after a double click.
+// Needs ENABLE_COUNTER and, for VFO mode, ENABLE_GESTURES.
+#define ENABLE_DIAGNOSTICS
+
+// Record the last few rotary control, tuning, oscillator and display
+// events. A double click on the diagnostics page sends them out of
+// the serial port. Needs ENABLE_DIAGNOSTICS and ENABLE_GESTURES.
+#define ENABLE_TRACE
+
+// Number of events recorded, 8 bytes of RAM each
+#define TRACE_LENGTH 16
+
+// Correct the crystal frequency for temperature using the chip's
+// temperature sensor and a curve stored in the EEPROM
+#define ENABLE_TEMP_COMP
+
+// Memory channels in VFO mode and a scanner that stops on channels
+// with a signal at the detector input. Needs ENABLE_GESTURES.
+#define ENABLE_MEMORIES
+
+// Several configuration profiles in the EEPROM, chosen by holding
+// the rotary control's switch at power up
+#define ENABLE_PROFILES
+
+// The first 128 bytes of the EEPROM hold two 48 byte configuration
+// profiles, the temperature compensation curve, the band stacking
+// registers and the selected profile number
+#define NUM_PROFILES 2
+#define TEMP_COMP_EEPROM_ADDRESS 96
+#define BAND_STACK_EEPROM_ADDRESS 100
+#define PROFILE_EEPROM_ADDRESS 127
+
+// The 32 byte user row holds the power fail record followed by
+// the memory channels, 3 bytes each
+#define POWER_FAIL_USERROW_OFFSET 0
+#define MEMORY_USERROW_OFFSET 20
+#define NUM_MEMORIES 4
+
+#endif
+
+// The Si5351 supports Fast-mode I2C but the LCD backpack doesn't so
+// the bus is switched to this rate only while writing to the oscillator
+#define I2C_FAST_CLOCK_RATE 400000
+
+// Shortest I2C rise time expected on the board (ns). A slower rise
+// only makes the clock slower than the rate asked for.
+#define I2C_RISE_TIME 100
+
 // Oscillator chip definitions
 // Have a different version of the Si5351A and a different crystal
 // on the ATtiny817 board
@@ -141,12 +267,70 @@ typedef uint8_t bool;
 // Address of the LCD display
 #define LCD_I2C_ADDRESS 0x27
 
+// Maximum RIT and XIT offset (Hz)
+#define MAX_RIT_OFFSET 9990
+
+// Minimum frequency counter gate time (ms). The gate is always
+// a whole number of cycles so may be longer at low frequencies.
+#define COUNTER_GATE_TIME 100
+
+// Maximum frequency counter input (Hz). The counter takes an
+// interrupt for every cycle so stops above this to leave time for
+// the rest of the firmware.
+#define COUNTER_MAX_FREQUENCY 20000UL
+
+// Minimum frequency counter input (Hz). Each cycle is timed with a
+// 16 bit timer at F_CPU/2 so a longer period wraps round and reads
+// too high. About 77Hz with the 10MHz CPU clock.
+#define COUNTER_MIN_FREQUENCY ((F_CPU / 2 + 65535) / 65536)
+
+// The clock used as the frequency counter reference and its frequency
+#define COUNTER_REF_CLOCK 2
+#define COUNTER_REF_FREQ  10000UL
+
+// Frequency of the reference used for crystal calibration
+#define CAL_REF_FREQ 10000UL
+
+// Number of counter measurements for each calibration step.
+// Each one takes two gate times. More measurements give a
+// more accurate result but take longer.
+#define CAL_MEASUREMENTS 20
+
+// Calibration is complete when the crystal frequency changes
+// by no more than this (Hz). This is limited by the counter's
+// resolution over CAL_MEASUREMENTS.
+#define CAL_THRESHOLD 20
+
+// Give up if calibration hasn't converged after this many steps
+#define CAL_MAX_STEPS 5
+
+// How often to measure the temperature for crystal temperature
+// compensation (ms), the temperature the curve is centred on (C)
+// and how much it must change before the correction is updated (C)
+#define TEMP_COMP_TIME 5000
+#define TEMP_COMP_REF_TEMP 25
+#define TEMP_COMP_HYSTERESIS 1
+
+// Time the memory scanner waits on each channel for the receiver to
+// settle before checking the detector (ms) and the detector level,
+// out of 1023 for the supply voltage, that counts as a signal
+#define MEMORY_SCAN_DWELL 250
+#define MEMORY_SCAN_SQUELCH 200
+
 // Time for debouncing a switch (ms)
 #define ROTARY_BUTTON_DEBOUNCE_TIME   100
 
 // Time for a key press to be a long press (ms)
 #define ROTARY_LONG_PRESS_TIME 250
 
+// Number of consecutive 1ms samples needed to confirm the push
+// switch has changed state
+#define BUTTON_DEBOUNCE_SAMPLES 5
+
+// Maximum time from releasing the push switch to pressing it
+// again for a double click (ms)
+#define BUTTON_DOUBLE_CLICK_TIME 300
+
 #define I2C_CLOCK_RATE 100000
 
 #endif /* CONFIG_H_ */
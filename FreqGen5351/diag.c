@@ -0,0 +1,164 @@
+/*
+ * diag.c
+ *
+ * Counters to help find out why the tuning feels slow in the
+ * field and a display page to show them.
+ *
+ * Times are measured with the millisecond tick so a loop time
+ * in the first bucket took less than 1ms.
+ *
+ * The free RAM is measured by filling it with a known value at
+ * startup and seeing how much of that the stack has overwritten.
+ *
+ * Created: 18/10/2026
+ */
+
+#include <inttypes.h>
+#include <string.h>
+#include <avr/pgmspace.h>
+
+#include "config.h"
+#include "millis.h"
+#include "display.h"
+#include "diag.h"
+
+#ifdef ENABLE_DIAGNOSTICS
+
+struct sDiagnostics diagnostics;
+
+// When the last loop iteration and the current event started
+static uint32_t loopStartTime;
+static uint32_t eventStartTime;
+
+// Upper limits of the loop time buckets in ms.
+// Anything longer goes in the last bucket.
+static const uint8_t loopBucketLimit[DIAG_LOOP_BUCKETS-1] PROGMEM = { 1, 5, 20 };
+
+// At startup the RAM between the end of .bss and the top of the stack
+// is filled with this so we can see how deep the stack has been
+#define STACK_PAINT 0xC5
+
+extern uint8_t _end;
+extern uint8_t __stack;
+
+// Runs from .init3, after the stack pointer is set up but before .data
+// and .bss, so it mustn't use the stack or rely on any variables
+void paintStack() __attribute__ ((naked, used, section(".init3")));
+void paintStack()
+{
+    uint8_t *p = &_end;
+
+    while( p <= &__stack )
+    {
+        *p++ = STACK_PAINT;
+    }
+}
+
+// Counter labels, in the same order as struct sDiagnostics
+#define DIAG_LABEL_LEN 11
+static const char diagLabels[DIAG_NUM_COUNTERS][DIAG_LABEL_LEN+1] PROGMEM =
+{
+    "Loop <1ms  ",
+    "Loop <5ms  ",
+    "Loop <20ms ",
+    "Loop 20ms+ ",
+    "Osc writes ",
+#ifdef ENABLE_OSC_CACHE
+    "Cache hits ",
+    "Cache miss ",
+#endif
+    "LCD updates",
+    "Turns      ",
+    "Turns no-op",
+    "Max lat ms ",
+    "Stack free ",
+};
+
+void diagLoop()
+{
+    uint32_t now = millis();
+    uint32_t loopTime = now - loopStartTime;
+    uint8_t i;
+
+    loopStartTime = now;
+    for( i = 0 ; i < (DIAG_LOOP_BUCKETS-1) ; i++ )
+    {
+        if( loopTime < pgm_read_byte(&loopBucketLimit[i]) )
+        {
+            break;
+        }
+    }
+    DIAG_COUNT(loopTime[i]);
+}
+
+void diagEventStart()
+{
+    eventStartTime = millis();
+}
+
+void diagEventEnd()
+{
+    uint32_t latency = millis() - eventStartTime;
+
+    if( latency > UINT16_MAX )
+    {
+        latency = UINT16_MAX;
+    }
+    if( latency > diagnostics.maxLatency )
+    {
+        diagnostics.maxLatency = latency;
+    }
+}
+
+void diagReset()
+{
+    memset( &diagnostics, 0, sizeof(diagnostics) );
+}
+
+// Count up from the end of .bss until we find a byte the stack has overwritten
+uint16_t diagStackFree()
+{
+    uint8_t *p = &_end;
+
+    while( (p <= &__stack) && (*p == STACK_PAINT) )
+    {
+        p++;
+    }
+    return p - &_end;
+}
+
+// Show two counters, one per line, with the label on the left
+// and the value right justified
+void diagDisplay( uint8_t page )
+{
+    uint8_t line, counter, i;
+    uint16_t value;
+    char buf[LCD_WIDTH+1];
+
+    diagnostics.stackFree = diagStackFree();
+
+    for( line = 0 ; line < 2 ; line++ )
+    {
+        counter = page*2 + line;
+        memset( buf, ' ', LCD_WIDTH );
+        buf[LCD_WIDTH] = '\0';
+
+        if( counter < DIAG_NUM_COUNTERS )
+        {
+            memcpy_P( buf, diagLabels[counter], DIAG_LABEL_LEN );
+            value = ((uint16_t *) &diagnostics)[counter];
+            for( i = LCD_WIDTH-1 ; i >= DIAG_LABEL_LEN ; i-- )
+            {
+                buf[i] = (value % 10) + '0';
+                value /= 10;
+                if( value == 0 )
+                {
+                    break;
+                }
+            }
+        }
+        displayText( line, buf, true );
+    }
+}
+
+#endif
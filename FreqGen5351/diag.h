@@ -0,0 +1,71 @@
+/*
+ * diag.h
+ *
+ * Created: 18/10/2026
+ */
+
+#ifndef DIAG_H
+#define DIAG_H
+
+#ifdef ENABLE_DIAGNOSTICS
+
+// Number of loop time histogram buckets
+#define DIAG_LOOP_BUCKETS 4
+
+// All the counters are 16 bit and stick at their maximum.
+// The order must match the labels in diag.c.
+struct sDiagnostics
+{
+    uint16_t loopTime[DIAG_LOOP_BUCKETS];   // Loop iterations by time taken
+    uint16_t oscWrites;                     // Frequency and enable writes to the oscillator
+#ifdef ENABLE_OSC_CACHE
+    uint16_t oscCacheHits;                  // Frequency writes skipped as the clock was already set
+    uint16_t oscCacheMisses;                // Frequency writes that had to go to the oscillator
+#endif
+    uint16_t lcdUpdates;                    // Display and cursor updates
+    uint16_t encoderEvents;                 // Rotary control turns
+    uint16_t encoderDropped;                // Turns rejected e.g. past the end of the frequency range
+    uint16_t maxLatency;                    // Worst time from a turn to the oscillator being set (ms)
+    uint16_t stackFree;                     // RAM between the heap and the stack never touched
+};
+
+extern struct sDiagnostics diagnostics;
+
+// Number of pages needed to show all the counters two at a time
+#define DIAG_NUM_COUNTERS (sizeof(struct sDiagnostics) / sizeof(uint16_t))
+#define DIAG_NUM_PAGES ((DIAG_NUM_COUNTERS + 1) / 2)
+
+#define DIAG_COUNT(counter) do { if( diagnostics.counter != UINT16_MAX ) diagnostics.counter++; } while( 0 )
+#define DIAG_LOOP() diagLoop()
+#define DIAG_EVENT_START() diagEventStart()
+#define DIAG_EVENT_END() diagEventEnd()
+
+// Call at the start of each loop iteration to time the last one
+void diagLoop();
+
+// Call either side of acting on a rotary control event
+// to record the worst case time taken
+void diagEventStart();
+void diagEventEnd();
+
+// Clear all the counters
+void diagReset();
+
+// Bytes of RAM between the end of .bss and the deepest the stack
+// has reached since reset
+uint16_t diagStackFree();
+
+// Show a page of counters on the display
+void diagDisplay( uint8_t page );
+
+#else
+
+// Compile to nothing when diagnostics are disabled
+#define DIAG_COUNT(counter) do {} while( 0 )
+#define DIAG_LOOP()
+#define DIAG_EVENT_START()
+#define DIAG_EVENT_END()
+
+#endif
+
+#endif //DIAG_H
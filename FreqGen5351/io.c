@@ -8,6 +8,7 @@
 #include <avr/io.h>
 #include <avr/cpufunc.h>
 #include <avr/interrupt.h>
+#include <avr/wdt.h>
 #include <util/atomic.h>
 
 #include <string.h>
@@ -30,6 +31,9 @@
 // Configure all the I/O we need
 void ioInit()
 {
+    // Run the CPU at F_CPU instead of the default 3.33MHz
+    _PROTECTED_WRITE( CLKCTRL.MCLKCTRLB, CLKCTRL_PDIV_2X_gc | CLKCTRL_PEN_bm );
+
     /* Set all pins to low power mode */
 
     for (uint8_t i = 0; i < 8; i++) {
@@ -60,6 +64,46 @@ void ioInit()
     ROTARY_ENCODER_B_DIR_REG &= ~(1 << ROTARY_ENCODER_B_PIN);
     ROTARY_ENCODER_B_PIN_CTRL |= (1 << PORT_PULLUPEN_bp);
 
+#ifdef ENABLE_RIT
+    // Set the PTT pin to an input with pull up
+    PTT_DIR_REG &= ~(1 << PTT_PIN);
+    PTT_PIN_CTRL |= (1 << PORT_PULLUPEN_bp);
+#endif
+
+#ifdef ENABLE_COUNTER
+    // Set the frequency counter pins to inputs with no pull up
+    COUNTER_IN_DIR_REG &= ~(1 << COUNTER_IN_PIN);
+    COUNTER_IN_PIN_CTRL &= ~(1 << PORT_PULLUPEN_bp);
+    COUNTER_REF_DIR_REG &= ~(1 << COUNTER_REF_PIN);
+    COUNTER_REF_PIN_CTRL &= ~(1 << PORT_PULLUPEN_bp);
+#endif
+
+#ifdef ENABLE_POWER_FAIL_SAVE
+    // Monitor the supply. The BOD must be enabled in the fuses.
+    BOD.VLMCTRLA = POWER_FAIL_VLM_LEVEL;
+#endif
+
+#if defined(ENABLE_TEMP_COMP) || defined(ENABLE_MEMORIES)
+    // Set up the ADC. The input and reference are chosen for each
+    // measurement. The temperature sensor needs at least 32us to sample.
+    VREF.CTRLA = (VREF.CTRLA & ~VREF_ADC0REFSEL_gm) | VREF_ADC0REFSEL_1V1_gc;
+    ADC0.CTRLD = ADC_INITDLY_DLY32_gc;
+    ADC0.SAMPCTRL = 31;
+    ADC0.CTRLA = ADC_ENABLE_bm;
+#endif
+
+#ifdef ENABLE_MEMORIES
+    // The detector input is analogue only
+    DETECTOR_PIN_CTRL = PORT_ISC_INPUT_DISABLE_gc;
+#endif
+
+#ifdef ENABLE_TRACE
+    // Transmit only serial port. The pin idles high.
+    SERIAL_TX_OUT_REG |= (1 << SERIAL_TX_PIN);
+    SERIAL_TX_DIR_REG |= (1 << SERIAL_TX_PIN);
+    USART0.BAUD = (4 * F_CPU + SERIAL_BAUD_RATE / 2) / SERIAL_BAUD_RATE;
+    USART0.CTRLB = USART_TXEN_bm;
+#endif
 
     /* Insert nop for synchronization*/
     _NOP();
@@ -83,6 +127,332 @@ void ioReadRotary( bool *pbA, bool *pbB, bool *pbSw )
     *pbSw = !(ROTARY_ENCODER_SW_IN_REG & (1 << ROTARY_ENCODER_SW_PIN));
 }
 
+// True if the PTT input is active i.e. we are transmitting
+bool ioReadPTT()
+{
+    return !(PTT_IN_REG & (1 << PTT_PIN));
+}
+
+#ifdef ENABLE_COUNTER
+// Reciprocal frequency counter
+//
+// TCB0 captures the period of each cycle of the signal routed to it
+// by event channel 0. The periods are added up until the gate time has
+// passed so the gate is always a whole number of cycles and the
+// resolution is one timer tick whatever the frequency.
+//
+// Measurements alternate between the counter input and the reference
+// input, which is a Si5351 output, so the caller can work out the
+// frequency without depending on the accuracy of the CPU clock.
+//
+// The timer runs at half the CPU clock so a cycle can be up to
+// 65535 ticks long.
+//
+// There is an interrupt for every cycle so a fast input would leave
+// no time for anything else. If a cycle is shorter than
+// COUNTER_MAX_FREQUENCY allows the interrupt is turned off and the
+// input is reported as over range.
+
+// Timer ticks in the minimum gate time
+#define COUNTER_GATE_TICKS ((F_CPU / 2000) * COUNTER_GATE_TIME)
+
+// Timer ticks in a cycle at the maximum frequency
+#define COUNTER_MIN_PERIOD ((F_CPU / 2) / COUNTER_MAX_FREQUENCY)
+
+// Running totals for the current gate
+static uint32_t gateTicks;
+static uint16_t gateCycles;
+
+// True if currently measuring the reference
+static bool bCountingRef;
+
+// True if the next capture is a part cycle after changing input
+static bool bSkipCapture;
+
+// The latest complete measurements
+static volatile uint32_t inTicks, refTicks;
+static volatile uint16_t inCycles, refCycles;
+static volatile bool bNewMeasurement;
+static volatile bool bOverRange;
+
+ISR(TCB0_INT_vect)
+{
+    // Reading the captured period clears the interrupt
+    uint16_t period = TCB0.CCMP;
+
+    if( bSkipCapture )
+    {
+        bSkipCapture = false;
+    }
+    else if( period < COUNTER_MIN_PERIOD )
+    {
+        // Too fast - stop before the interrupts take all the CPU time
+        TCB0.INTCTRL = 0;
+        bOverRange = true;
+    }
+    else
+    {
+        gateTicks += period;
+        gateCycles++;
+
+        // At the end of the gate save the measurement and
+        // swap between the input and the reference
+        if( gateTicks >= COUNTER_GATE_TICKS )
+        {
+            if( bCountingRef )
+            {
+                refTicks = gateTicks;
+                refCycles = gateCycles;
+                EVSYS.ASYNCCH0 = COUNTER_IN_EVENT;
+            }
+            else
+            {
+                inTicks = gateTicks;
+                inCycles = gateCycles;
+                bNewMeasurement = true;
+                EVSYS.ASYNCCH0 = COUNTER_REF_EVENT;
+            }
+            bCountingRef = !bCountingRef;
+            bSkipCapture = true;
+            gateTicks = 0;
+            gateCycles = 0;
+        }
+    }
+}
+
+void ioCounterEnable( bool bEnable )
+{
+    if( bEnable )
+    {
+        // Start by measuring the reference
+        bCountingRef = true;
+        bSkipCapture = true;
+        bNewMeasurement = false;
+        bOverRange = false;
+        refCycles = 0;
+        gateTicks = 0;
+        gateCycles = 0;
+
+        EVSYS.ASYNCCH0 = COUNTER_REF_EVENT;
+        EVSYS.ASYNCUSER0 = EVSYS_ASYNCUSER0_ASYNCCH0_gc;
+
+        // Capture the period on each rising edge
+        TCB0.CTRLB = TCB_CNTMODE_FRQ_gc;
+        TCB0.EVCTRL = TCB_CAPTEI_bm;
+        TCB0.INTFLAGS = TCB_CAPT_bm;
+        TCB0.INTCTRL = TCB_CAPT_bm;
+        TCB0.CTRLA = TCB_CLKSEL_CLKDIV2_gc | TCB_ENABLE_bm;
+    }
+    else
+    {
+        TCB0.CTRLA = 0;
+        TCB0.INTCTRL = 0;
+        EVSYS.ASYNCUSER0 = EVSYS_ASYNCUSER0_OFF_gc;
+        EVSYS.ASYNCCH0 = EVSYS_ASYNCCH0_OFF_gc;
+    }
+}
+
+bool ioCounterRead( uint16_t *pInCycles, uint32_t *pInTicks, uint16_t *pRefCycles, uint32_t *pRefTicks )
+{
+    bool bNew = false;
+
+    ATOMIC_BLOCK( ATOMIC_RESTORESTATE )
+    {
+        // Only have a result once the reference has been measured
+        if( bNewMeasurement && refCycles )
+        {
+            *pInCycles = inCycles;
+            *pInTicks = inTicks;
+            *pRefCycles = refCycles;
+            *pRefTicks = refTicks;
+            bNew = true;
+        }
+        bNewMeasurement = false;
+    }
+
+    return bNew;
+}
+
+bool ioCounterOverRange()
+{
+    return bOverRange;
+}
+#endif
+
+// True if the last reset was not a power on reset so RAM may still
+// hold the state from before. Clears the reset flags.
+bool ioWarmReset()
+{
+    uint8_t flags = RSTCTRL.RSTFR;
+
+    RSTCTRL.RSTFR = flags;
+    return !(flags & RSTCTRL_PORF_bm);
+}
+
+// True if the supply has fallen below the voltage level monitor
+// threshold i.e. the power is about to go
+bool ioPowerFailing()
+{
+    return BOD.STATUS & BOD_VLMS_bm;
+}
+
+#ifdef ENABLE_POWER_FAIL_SAVE
+// Call powerFailSave() from the voltage level monitor interrupt as
+// soon as the supply falls below the threshold, whatever the main
+// loop is doing at the time
+void ioPowerFailEnable()
+{
+    BOD.INTFLAGS = BOD_VLMIF_bm;
+    BOD.INTCTRL = BOD_VLMCFG_BELOW_gc | BOD_VLMIE_bm;
+}
+
+ISR(BOD_VLM_vect)
+{
+    BOD.INTFLAGS = BOD_VLMIF_bm;
+    powerFailSave();
+}
+#endif
+
+// The user row is a single page of non-volatile memory separate from
+// the EEPROM. All of it is written with one erase/write so it is much
+// quicker than writing the same amount of EEPROM a byte at a time.
+// As with the EEPROM only the bytes loaded into the page buffer are
+// erased and written so the rest of the page is left alone.
+void ioReadUserRow( uint8_t offset, uint8_t *pData, uint8_t len )
+{
+    uint8_t i;
+
+    for( i = 0 ; i < len ; i++ )
+    {
+        pData[i] = ((volatile uint8_t *) USER_SIGNATURES_START)[offset + i];
+    }
+}
+
+void ioWriteUserRow( uint8_t offset, const uint8_t *pData, uint8_t len )
+{
+    uint8_t i;
+
+    // Wait for any EEPROM write to finish. The power fail save may
+    // have interrupted an EEPROM write part way through loading the
+    // page buffer so clear it before filling it. The power fail save
+    // also writes the user row so don't let it in until we're done.
+    while( NVMCTRL.STATUS & NVMCTRL_EEBUSY_bm );
+    ATOMIC_BLOCK( ATOMIC_RESTORESTATE )
+    {
+        _PROTECTED_WRITE_SPM( NVMCTRL.CTRLA, NVMCTRL_CMD_PAGEBUFCLR_gc );
+        for( i = 0 ; i < len ; i++ )
+        {
+            ((volatile uint8_t *) USER_SIGNATURES_START)[offset + i] = pData[i];
+        }
+
+        _PROTECTED_WRITE_SPM( NVMCTRL.CTRLA, NVMCTRL_CMD_PAGEERASEWRITE_gc );
+    }
+}
+
+// Load bytes into the EEPROM page buffer without writing them.
+// ioWriteEepromPage() then writes all the bytes loaded with one
+// erase/write instead of one for each byte. All the bytes must be
+// in the same EEPROM page.
+void ioLoadEeprom( uint8_t address, const uint8_t *pData, uint8_t len )
+{
+    uint8_t i;
+
+    // Wait for any write to finish then fill the page buffer
+    while( NVMCTRL.STATUS & NVMCTRL_EEBUSY_bm );
+    for( i = 0 ; i < len ; i++ )
+    {
+        ((volatile uint8_t *) EEPROM_START)[address + i] = pData[i];
+    }
+}
+
+void ioWriteEepromPage()
+{
+    _PROTECTED_WRITE_SPM( NVMCTRL.CTRLA, NVMCTRL_CMD_PAGEERASEWRITE_gc );
+}
+
+// Start measuring the chip temperature against the 1.1V reference
+void ioTempStart()
+{
+    ADC0.CTRLC = ADC_SAMPCAP_bm | ADC_REFSEL_INTREF_gc | ADC_PRESC_DIV16_gc;
+    ADC0.MUXPOS = ADC_MUXPOS_TEMPSENSE_gc;
+    ADC0.INTFLAGS = ADC_RESRDY_bm;
+    ADC0.COMMAND = ADC_STCONV_bm;
+}
+
+// Get the chip temperature in C once the measurement has finished.
+// Returns false if it hasn't finished yet.
+bool ioTempRead( int8_t *pTemp )
+{
+    uint32_t temp;
+
+    if( !(ADC0.INTFLAGS & ADC_RESRDY_bm) )
+    {
+        return false;
+    }
+
+    // Apply the factory calibration from the signature row to get
+    // the temperature in Kelvin. Reading the result clears the flag.
+    temp = ADC0.RES - (int8_t) SIGROW.TEMPSENSE1;
+    temp *= SIGROW.TEMPSENSE0;
+    temp += 0x80;
+    temp >>= 8;
+    *pTemp = temp - 273;
+
+    return true;
+}
+
+// Start measuring the detector voltage against the supply
+void ioDetectorStart()
+{
+    ADC0.CTRLC = ADC_REFSEL_VDDREF_gc | ADC_PRESC_DIV16_gc;
+    ADC0.MUXPOS = DETECTOR_MUXPOS;
+    ADC0.INTFLAGS = ADC_RESRDY_bm;
+    ADC0.COMMAND = ADC_STCONV_bm;
+}
+
+// Get the detector voltage once the measurement has finished.
+// Returns false if it hasn't finished yet.
+bool ioDetectorRead( uint16_t *pLevel )
+{
+    if( !(ADC0.INTFLAGS & ADC_RESRDY_bm) )
+    {
+        return false;
+    }
+
+    *pLevel = ADC0.RES;
+    return true;
+}
+
+// Send a byte out of the serial port once there is room
+void ioSerialWrite( uint8_t data )
+{
+    while( !(USART0.STATUS & USART_DREIF_bm) );
+    USART0.TXDATAL = data;
+}
+
+#ifdef I2C_FAST_CLOCK_RATE
+// TWI master baud setting for an I2C clock rate. From the datasheet
+//  f(SCL) = F_CPU / (10 + 2 * BAUD + F_CPU * t(rise))
+// Everything is rounded so the clock is never above the rate and the
+// rise time is in ns.
+#define I2C_RISE_CYCLES ((F_CPU / 1000000UL) * I2C_RISE_TIME / 1000)
+#define I2C_BAUD(rate) ((((F_CPU + (rate) - 1) / (rate)) - 10 - I2C_RISE_CYCLES + 1) / 2)
+
+// Switch the I2C bus between I2C_FAST_CLOCK_RATE and I2C_CLOCK_RATE.
+// Must only be called between transactions. The baud rate can only be
+// changed while the master is disabled, and enabling it again leaves
+// the bus state unknown so force it back to idle.
+void ioI2CFast( bool bFast )
+{
+    uint8_t ctrla = TWI0.MCTRLA;
+
+    TWI0.MCTRLA = ctrla & ~TWI_ENABLE_bm;
+    TWI0.MBAUD = bFast ? I2C_BAUD(I2C_FAST_CLOCK_RATE) : I2C_BAUD(I2C_CLOCK_RATE);
+    TWI0.MCTRLA = ctrla;
+    TWI0.MSTATUS = TWI_BUSSTATE_IDLE_gc;
+}
+#endif
+
 #else
 
 // ATtiny85
@@ -104,4 +474,18 @@ void ioInit()
     /* Insert nop for synchronization*/
     _NOP();
 }
+
+// True if the last reset was not a power on reset so RAM may still
+// hold the state from before. Clears the reset flags.
+bool ioWarmReset()
+{
+    uint8_t flags = MCUSR;
+
+    // The watchdog stays enabled after a watchdog reset until the
+    // flag is cleared and it is turned off
+    MCUSR = 0;
+    wdt_disable();
+
+    return !(flags & (1 << PORF));
+}
 #endif
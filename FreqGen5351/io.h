@@ -14,4 +14,54 @@ void ioInit();
 // Read the rotary switch
 void ioReadRotary( bool *pbA, bool *pbB, bool *pbSw );
 
+// Read the PTT input
+bool ioReadPTT();
+
+// Start and stop the frequency counter
+void ioCounterEnable( bool bEnable );
+
+// Get the latest frequency counter measurement of the input
+// and the reference. Returns true if there is a new one.
+bool ioCounterRead( uint16_t *pInCycles, uint32_t *pInTicks, uint16_t *pRefCycles, uint32_t *pRefTicks );
+
+// True if the counter has stopped because the input is above
+// COUNTER_MAX_FREQUENCY. Enable the counter again to retry.
+bool ioCounterOverRange();
+
+// True if the last reset was not a power on reset
+bool ioWarmReset();
+
+// True if the supply is failing
+bool ioPowerFailing();
+
+// Call powerFailSave() from an interrupt as soon as the supply
+// starts to fail. It is provided by the main code.
+void ioPowerFailEnable();
+void powerFailSave();
+
+// Read and write part of the non-volatile user row
+void ioReadUserRow( uint8_t offset, uint8_t *pData, uint8_t len );
+void ioWriteUserRow( uint8_t offset, const uint8_t *pData, uint8_t len );
+
+// Load bytes into the EEPROM page buffer and then write them all
+// at once. The bytes must be in the same page.
+void ioLoadEeprom( uint8_t address, const uint8_t *pData, uint8_t len );
+void ioWriteEepromPage();
+
+// Measure the chip temperature. Start the measurement and then
+// read it when ready, returning false if it isn't ready yet.
+void ioTempStart();
+bool ioTempRead( int8_t *pTemp );
+
+// Measure the receiver's detector voltage in the same way
+void ioDetectorStart();
+bool ioDetectorRead( uint16_t *pLevel );
+
+// Send a byte out of the serial port
+void ioSerialWrite( uint8_t data );
+
+// Switch the I2C bus to the fast rate for the oscillator or
+// back to the standard rate
+void ioI2CFast( bool bFast );
+
 #endif //IO_H
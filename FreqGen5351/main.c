@@ -21,12 +21,21 @@
 #include "rotary.h"
 #include "display.h"
 #include "i2c.h"
+#ifdef ENABLE_GESTURES
+#include "button.h"
+#endif
+#include "diag.h"
+#include "trace.h"
 
 // Number of clocks under control
 #define NUM_CLOCKS 3
 
 // Set to true if we are in VFO mode rather than frequency generator mode
+#ifdef FIXED_VFO_MODE
+#define bVfoMode FIXED_VFO_MODE
+#else
 static bool bVfoMode;
+#endif
 
 // Amount to change the VFO in fast and normal modes
 //#define VFO_CHANGE_FAST     100
@@ -36,6 +45,9 @@ static bool bVfoMode;
 //#define VFO_SPEED_UP_DIFF   150  // If dial clicks are no more than this ms apart then speed up
 //#define VFO_SPEED_UP_FACTOR  10  // Multiply the rate by this
 
+// The crystal frequency
+static uint32_t xtalFreq;
+
 // The clock frequencies
 static uint32_t clockFreq[NUM_CLOCKS];
 
@@ -57,9 +69,122 @@ static int8_t quadrature = 0;
 // True if we need to update the display e.g. frequency has changed
 static bool bUpdateDisplay;
 
+#ifdef ENABLE_COUNTER
+// After the last clock a long press moves to the frequency counter
+#define COUNTER_PAGE NUM_CLOCKS
+
+// The latest frequency counter measurement and when it was made
+static uint32_t counterFreq;
+static uint32_t counterTime;
+
+// If there is no measurement for this long (ms) then there is no signal.
+// An input that is over range is tried again after this long.
+#define COUNTER_TIMEOUT 1000
+
+// Shown as over range instead of a frequency
+#define COUNTER_OVER_RANGE ULONG_MAX
+#endif
+
+#ifdef ENABLE_DIAGNOSTICS
+// After the counter a long press moves to the diagnostics page
+#define DIAG_PAGE (COUNTER_PAGE+1)
+
+// Which counters are displayed and when they were last refreshed
+static uint8_t diagPage;
+static uint32_t diagTime;
+
+// How often to refresh the diagnostics page (ms)
+#define DIAG_UPDATE_TIME 500
+
+#ifdef ENABLE_TRACE
+// A press clears the counters but not until it can no longer be the
+// first click of a double click to send the trace
+static bool bDiagResetPending;
+static uint32_t diagResetTime;
+#endif
+#endif
+
+#ifdef ENABLE_CALIBRATION
+// The calibration reference has to be measured by the counter
+#if (CAL_REF_FREQ < COUNTER_MIN_FREQUENCY) || (CAL_REF_FREQ > COUNTER_MAX_FREQUENCY)
+#error "CAL_REF_FREQ is outside the frequency counter's range"
+#endif
+
+// True if calibrating the crystal frequency against the
+// reference on the counter input
+static bool bCalibrating;
+
+// Number of calibration steps so far
+static uint8_t calSteps;
+
+// Counter measurements added up for this calibration step
+static uint8_t calMeasurements;
+static uint32_t calInCycles, calInTicks, calRefCycles, calRefTicks;
+#endif
+
+#ifdef ENABLE_TEMP_COMP
+// The temperature compensation applied to the crystal frequency (Hz),
+// the temperature it was worked out for and when it was last checked
+static int32_t xtalCorrection;
+static int8_t xtalCorrectionTemp = INT8_MIN;
+static uint32_t tempCompTime;
+
+// True while waiting for a temperature measurement
+static bool bTempMeasuring;
+#endif
+
+#ifdef ENABLE_MEMORIES
+// The memory channel selected in VFO setting mode. NUM_MEMORIES
+// means scan through them all.
+static uint8_t currentMemory;
+#define MEMORY_SCAN NUM_MEMORIES
+
+// The channel on the selector. Turning it doesn't change anything
+// else, a press recalls the channel or starts the scan but not until
+// it can no longer be the first click of a double click to store it.
+static uint8_t memorySelection;
+static bool bMemoryRecallPending;
+static uint32_t memoryRecallTime;
+
+// The channel the scanner is on, when it got there and whether it is
+// waiting for the detector to be measured
+static uint8_t scanChannel;
+
+// Where the cursor was before the last click. The first click of a
+// double click has already moved it on by the time the double click
+// is recognised.
+static uint8_t clickCursorIndex;
+static uint32_t scanTime;
+static bool bScanSampling;
+
+// Position of the memory channel on the bottom line of the display
+#define MEMORY_X (LCD_WIDTH-2)
+#endif
+
+// Anything that has to be done around the oscillator writes needs
+// setOscFrequency() and enableOscClock(). Otherwise they are the
+// oscillator functions so the ATtiny85 builds don't pay for them.
+#if defined(ENABLE_OSC_CACHE) || defined(I2C_FAST_CLOCK_RATE) || defined(ENABLE_DIAGNOSTICS) || defined(ENABLE_TRACE)
+#define OSC_WRAPPERS
+#endif
+
+#ifdef ENABLE_OSC_CACHE
+// The frequency and quadrature last written to each oscillator clock.
+// Mode and offset changes often ask for a setting the chip already
+// has e.g. the superhet BFO is unchanged by every tuning step, so we
+// only work out the dividers and write them when something has changed.
+static uint32_t oscFreq[NUM_CLOCKS];
+static int8_t oscQuadrature[NUM_CLOCKS];
+#endif
+
 // DISPLAY_BAND adds a band display but there is no space in the
-// flash on ATtiny85 so only define on other platforms
+// flash on ATtiny85 so only define on other platforms. The VFO only
+// build frees the frequency generator code so may have room for it -
+// check the size report from build.sh before using it there.
 //#define DISPLAY_BAND
+#ifdef ENABLE_BAND_STACK
+#define DISPLAY_BAND
+#endif
 
 #ifdef DISPLAY_BAND
 // Band frequencies
@@ -92,6 +217,20 @@ band[NUM_BANDS + 1] PROGMEM =
 static uint8_t currentBand = OUT_OF_BAND;
 #endif
 
+#ifdef ENABLE_BAND_STACK
+// Band stacking registers - the last frequency and mode used on each
+// band (not including out-of-band)
+static struct
+{
+    uint32_t freq;
+    enum eMode mode;
+}
+bandStack[NUM_BANDS];
+
+// Set when the band stacking registers need saving to EEPROM
+static bool bBandStackDirty;
+#endif
+
 // Text for the modes
 #define NUM_MODES 4
 #define MODE_TEXT_LEN 4 // Includes terminating null
@@ -103,9 +242,62 @@ static const char modeText[NUM_MODES][MODE_TEXT_LEN] PROGMEM =
     "CWR"
 };
 
+// Quadrature and frequency offsets for each mode in the same order as
+// enum eMode so that a mode change is just a table lookup.
+//
+// For the quadrature direct conversion VFO the offset is applied to the
+// VFO. For the superhet the VFO is high-side, RX frequency plus the
+// filter centre frequency plus vfoOffset, and the BFO is the filter
+// centre frequency plus bfoOffset.
+//
+// For CW we want the RX frequency to go to the centre of the filter
+// passband but the BFO needs an offset. For sideband we want the centre
+// of the RX signal to go to the centre of the filter.
+static const struct
+{
+    int8_t  quadrature;     // Quadrature for the direct conversion VFO
+    int16_t dcOffset;       // Direct conversion VFO offset
+    int16_t vfoOffset;      // Superhet VFO offset
+    int16_t bfoOffset;      // Superhet BFO offset
+}
+modeOffsets[NUM_MODES] PROGMEM =
+{
+    {  1,          0,  SSB_OFFSET,  SSB_OFFSET },  // USB
+    { -1,          0, -SSB_OFFSET, -SSB_OFFSET },  // LSB
+    {  1, -CW_OFFSET,           0,   CW_OFFSET },  // CW is like USB
+    { -1,  CW_OFFSET,           0,  -CW_OFFSET },  // CWR is like LSB
+};
+
 // Current reception mode
 static enum eMode currentMode;
 
+#ifdef ENABLE_RIT
+// RIT moves the RX frequency and XIT the TX frequency away from VFO A.
+// Split transmits on VFO B which is held in clock 1's frequency as
+// clock 1 is not otherwise used in VFO mode.
+enum eOffsetMode
+{
+    OFFSET_NONE,
+    OFFSET_RIT,
+    OFFSET_XIT,
+    OFFSET_SPLIT,
+    NUM_OFFSET_MODES
+};
+static enum eOffsetMode offsetMode;
+
+// The RIT or XIT offset
+static int16_t offset;
+
+// True if adjusting the offset or the split frequency
+static bool bOffsetSetting;
+
+// True if the PTT input is active
+static bool bTransmit;
+
+// Position of the offset on the top line of the display
+#define OFFSET_X (LCD_WIDTH-6)
+#endif
+
 // The cursor position along with its corresponding frequency change
 struct sCursorPos
 {
@@ -122,6 +314,12 @@ struct sCursorPos
 #define CHANGE_BAND 7777
 #endif
 #define CHANGE_MODE 8888
+#ifdef ENABLE_RIT
+#define CHANGE_OFFSET 6666
+#endif
+#ifdef ENABLE_MEMORIES
+#define CHANGE_MEMORY 5555
+#endif
 #define CONTROL_CHARACTER 9999
 
 // The cursor transitions for the VFO
@@ -142,12 +340,45 @@ static const struct sCursorPos vfoCursorSettingTransition[] PROGMEM =
     { 2, 1, 1000000 },
 #ifdef DISPLAY_BAND
     { 0, 0, CHANGE_BAND },
+    { BAND_NAME_LEN, 0, CHANGE_MODE },
 #else
     { 0, 0, CHANGE_MODE },
 #endif
+#ifdef ENABLE_MEMORIES
+    { MEMORY_X+1, 1, CHANGE_MEMORY },
+#endif
+    { CURSOR_TRANSITION_END, CURSOR_TRANSITION_END, CURSOR_TRANSITION_END }
+};
+
+#ifdef ENABLE_RIT
+// The cursor transitions for the RIT and XIT offset
+static const struct sCursorPos vfoCursorOffsetTransition[] PROGMEM =
+{
+    { OFFSET_X+4, 0, 10 },
+    { OFFSET_X+3, 0, 100 },
+    { OFFSET_X+2, 0, 1000 },
+    { OFFSET_X,   0, CHANGE_OFFSET },
+    { CURSOR_TRANSITION_END, CURSOR_TRANSITION_END, CURSOR_TRANSITION_END }
+};
+
+// The index in the above table for the offset mode
+#define OFFSET_CONTROL_INDEX 3
+
+// The cursor transitions for the split frequency
+static const struct sCursorPos vfoCursorSplitTransition[] PROGMEM =
+{
+    { 9, 1, 10 },
+    { 8, 1, 100 },
+    { 6, 1, 1000 },
+    { 5, 1, 10000 },
+    { OFFSET_X, 0, CHANGE_OFFSET },
     { CURSOR_TRANSITION_END, CURSOR_TRANSITION_END, CURSOR_TRANSITION_END }
 };
 
+// The index in the above table for the offset mode
+#define SPLIT_CONTROL_INDEX 4
+#endif
+
 // The cursor transitions for the frequency generator
 static const struct sCursorPos freqGenCursorTransition[] PROGMEM =
 {
@@ -304,218 +535,693 @@ static void convertNumber( char *buf, uint8_t len, uint32_t number, bool bShort,
 
 #ifdef DISPLAY_BAND
 // Get the current band for a frequency
+// The bands are in frequency order so this is a binary search for
+// the highest band starting at or below the frequency
 static uint8_t getBand( uint32_t frequency )
 {
-    uint8_t i;
-    uint8_t bandIndex = OUT_OF_BAND;
+    uint8_t low = 1;
+    uint8_t high = NUM_BANDS;
 
-    for( i = 1 ; i <= NUM_BANDS ; i++ )
+    while( low < high )
     {
-        if( (frequency >= pgm_read_dword(&band[i].minFreq)) && (frequency <= pgm_read_dword(&band[i].maxFreq)) )
+        uint8_t mid = (low + high + 1) / 2;
+
+        if( frequency >= pgm_read_dword(&band[mid].minFreq) )
         {
-            bandIndex = i;
-            break;
+            low = mid;
+        }
+        else
+        {
+            high = mid - 1;
+        }
+    }
+
+    if( (frequency >= pgm_read_dword(&band[low].minFreq)) && (frequency <= pgm_read_dword(&band[low].maxFreq)) )
+    {
+        return low;
+    }
+    else
+    {
+        return OUT_OF_BAND;
+    }
+}
+
+// Keep track of the band as VFO A is tuned
+static void updateBand( uint32_t f )
+{
+    // Only need to search if we have left the current band
+    if( (f < pgm_read_dword(&band[currentBand].minFreq)) || (f > pgm_read_dword(&band[currentBand].maxFreq)) )
+    {
+        currentBand = getBand( f );
+    }
+
+#ifdef ENABLE_BAND_STACK
+    // Remember where we are on this band. It is saved to EEPROM
+    // when the power fails.
+    if( currentBand != OUT_OF_BAND )
+    {
+        uint8_t i = currentBand - 1;
+        if( (bandStack[i].freq != f) || (bandStack[i].mode != currentMode) )
+        {
+            bandStack[i].freq = f;
+            bandStack[i].mode = currentMode;
+            bBandStackDirty = true;
         }
     }
+#endif
+}
+#endif
+
+#ifdef OSC_WRAPPERS
+// Write a clock's frequency and quadrature to the oscillator chip
+// unless it is already set to them
+static void setOscFrequency( uint8_t clock, uint32_t f, int8_t q )
+{
+#ifdef ENABLE_OSC_CACHE
+    if( (f == oscFreq[clock]) && (q == oscQuadrature[clock]) )
+    {
+        DIAG_COUNT(oscCacheHits);
+        return;
+    }
+    DIAG_COUNT(oscCacheMisses);
+    oscFreq[clock] = f;
+    oscQuadrature[clock] = q;
+#endif
+#ifdef I2C_FAST_CLOCK_RATE
+    ioI2CFast( true );
+#endif
+    oscSetFrequency( clock, f, q );
+#ifdef I2C_FAST_CLOCK_RATE
+    ioI2CFast( false );
+#endif
+    DIAG_COUNT(oscWrites);
+    TRACE( traceOscFrequency, clock, f );
+}
+
+// Turn an output on or off
+static void enableOscClock( uint8_t clock, bool bEnable )
+{
+#ifdef I2C_FAST_CLOCK_RATE
+    ioI2CFast( true );
+#endif
+    oscClockEnable( clock, bEnable );
+    DIAG_COUNT(oscWrites);
+    TRACE( traceOscEnable, clock, bEnable );
+#ifdef I2C_FAST_CLOCK_RATE
+    ioI2CFast( false );
+#endif
+}
+#else
+#define setOscFrequency oscSetFrequency
+#define enableOscClock  oscClockEnable
+#endif
+
+#ifdef ENABLE_RIT
+// Get the VFO frequency after applying RIT, XIT or split
+// for whether we are receiving or transmitting
+static uint32_t vfoFrequency()
+{
+    uint32_t f = clockFreq[0];
+
+    switch( offsetMode )
+    {
+        case OFFSET_RIT:
+            if( !bTransmit )
+            {
+                f += offset;
+            }
+            break;
+
+        case OFFSET_XIT:
+            if( bTransmit )
+            {
+                f += offset;
+            }
+            break;
+
+        case OFFSET_SPLIT:
+            if( bTransmit )
+            {
+                f = clockFreq[1];
+            }
+            break;
+
+        default:
+            break;
+    }
+
+    return f;
+}
 
-    return bandIndex;
+// Select the cursor transitions for the offset mode.
+// If there is no offset go straight to the offset mode.
+static void setOffsetCursor()
+{
+    if( offsetMode == OFFSET_SPLIT )
+    {
+        // Adjusting the split frequency is adjusting clock 1
+        currentClock = 1;
+        pCursorTransitions = vfoCursorSplitTransition;
+        cursorIndex = SPLIT_CONTROL_INDEX;
+    }
+    else
+    {
+        currentClock = 0;
+        pCursorTransitions = vfoCursorOffsetTransition;
+        cursorIndex = (offsetMode == OFFSET_NONE) ? OFFSET_CONTROL_INDEX : 0;
+    }
 }
 #endif
 
 // Set the frequency.
 static void setFrequency( uint8_t clock, uint32_t f, int8_t q )
 {
+    TRACE( traceFrequency, clock, f );
+
 	// In VFO mode we don't just set the frequencies but have to
 	// work out quadrature and offsets depending on whether we
 	// are quadrature direct conversion or superhet
     if( bVfoMode )
     {
+#ifdef DISPLAY_BAND
+        // The band follows VFO A before any offset is applied
+        if( clock == 0 )
+        {
+            updateBand( f );
+        }
+#endif
+
+#ifdef ENABLE_RIT
+        // Whichever of VFO A, VFO B or the offset has changed
+        // the VFO is set for the current RX or TX frequency
+        clock = 0;
+        f = vfoFrequency();
+#endif
+
 		// If clock frequency 2 is zero then this is the VFO for
 		// a quadrature direct conversion receiver
 		if( clockFreq[2] == 0)
 		{
-			uint32_t freq;
-			int8_t   quad;
-		
-			switch( currentMode )
-			{
-				case MODE_CW:
-					quad = 1;
-					freq = f - CW_OFFSET;
-					break;
-
-				case MODE_USB:
-					quad = 1;
-					freq = f;
-					break;
-
-				case MODE_CWR:
-					quad = -1;
-					freq = f + CW_OFFSET;
-					break;
-
-				case MODE_LSB:
-					quad = -1;
-					freq = f;
-					break;
-			}
-
 			// In quadrature VFO mode only use the frequency for clock 0 and
 			// need to set the quadrature and frequency offset
 			// depending on the mode
 			if( clock == 0 )
 			{
+				uint32_t freq = f + (int16_t) pgm_read_word(&modeOffsets[currentMode].dcOffset);
+				int8_t   quad = (int8_t) pgm_read_byte(&modeOffsets[currentMode].quadrature);
 
 				// In VFO mode set clocks 0 and 1 to match
-				oscSetFrequency( 0, freq, quad );
-				oscSetFrequency( 1, freq, quad );
-
-#ifdef DISPLAY_BAND
-				// Set the band if it has changed - use the frequency before the offset is applied
-				if( (f < pgm_read_dword(&band[currentBand].minFreq)) || (f > pgm_read_dword(&band[currentBand].maxFreq)) )
-				{
-					currentBand = getBand( f );
-				}
-#endif
+				setOscFrequency( 0, freq, quad );
+				setOscFrequency( 1, freq, quad );
 			}
 		}
 		else
 		{
-			// In superhet VFO mode need to work out the VFO and BFO frequencies
-		    uint32_t vfoFreq, bfoFreq;
-
-			// The clock 2 frequency is the centre frequency of the filter
-			uint32_t filterFreq = clockFreq[2];
-
-			// The VFO and BFO frequencies depend on whether CW or which sideband
-			// We are assuming that the VFO will be higher than the RX frequency
-			switch( currentMode )
-			{
-				case MODE_CW:
-					// For CW we want the RX frequency to go to the centre of
-					// the filter passband but the BFO needs an offset
-					// Equivalent to USB
-					vfoFreq = f + filterFreq;
-					bfoFreq = filterFreq + CW_OFFSET;
-					break;
-
-				case MODE_CWR:
-					// CW Reverse is the same as CW but treat it like LSB
-					vfoFreq = f + filterFreq;
-					bfoFreq = filterFreq - CW_OFFSET;
-					break;
-
-				case MODE_USB:
-					// For sideband we want the centre of the RX signal to go to
-					// the centre of the filter
-					vfoFreq = f + filterFreq + SSB_OFFSET;
-					bfoFreq = filterFreq + SSB_OFFSET;
-					break;
-
-				case MODE_LSB:
-					vfoFreq = f + filterFreq - SSB_OFFSET;
-					bfoFreq = filterFreq - SSB_OFFSET;
-					break;
-			}
-
-			// We set up clock 0 for the VFO and clock 2 for the BFO but
-			// only do it when setting clock 0
+			// In superhet VFO mode we set up clock 0 for the VFO and
+			// clock 2 for the BFO but only do it when setting clock 0.
+			// The clock 2 frequency is the centre frequency of the filter.
+			// The BFO only changes with the mode so tuning just
+			// writes the VFO.
 			if( clock == 0 )
 			{
-				oscSetFrequency( 0, vfoFreq, 0 );
-				oscSetFrequency( 2, bfoFreq, 0 );
+				uint32_t filterFreq = clockFreq[2];
+
+				setOscFrequency( 2, filterFreq + (int16_t) pgm_read_word(&modeOffsets[currentMode].bfoOffset), 0 );
+				setOscFrequency( 0, f + filterFreq + (int16_t) pgm_read_word(&modeOffsets[currentMode].vfoOffset), 0 );
 			}
 		}
     }
     else
     {
         // In non-VFO mode just set the quadrature and frequency as passed
-        oscSetFrequency( clock, f, q );
+        setOscFrequency( clock, f, q );
     }
 }
 
 
 
-// When the button is pressed we move to the next digit to change
-static void nextFreqChangeDigit()
+#ifdef ENABLE_COUNTER
+// Start or stop the frequency counter. While it is running the
+// reference clock is taken over to provide the timebase.
+static void enableCounter( bool bEnable )
 {
-    cursorIndex++;
-    if( pgm_read_byte(&pCursorTransitions[cursorIndex].x) == CURSOR_TRANSITION_END )
+    if( bEnable )
     {
-        cursorIndex = 0;
+        setOscFrequency( COUNTER_REF_CLOCK, COUNTER_REF_FREQ, 0 );
+        enableOscClock( COUNTER_REF_CLOCK, true );
     }
+    else
+    {
+        setFrequency( COUNTER_REF_CLOCK, clockFreq[COUNTER_REF_CLOCK], quadrature );
+        enableOscClock( COUNTER_REF_CLOCK, bClockEnabled[COUNTER_REF_CLOCK] );
+    }
+    counterFreq = 0;
+    counterTime = millis();
+    ioCounterEnable( bEnable );
 }
+#endif
 
-// Handle the rotary control while in the standard clock generator mode
-static void handleRotary( bool bCW, bool bCCW, bool bShortPress, bool bLongPress )
+#if defined(ENABLE_CALIBRATION) || defined(ENABLE_TEMP_COMP)
+// Set a new crystal frequency. All the clocks must then be set
+// again as their dividers depend on it.
+static void setXtalFrequency( uint32_t xtal )
 {
-    uint32_t currentOscFreq, newOscFreq;
-    bool bCurrentClockEnabled, bNewClockEnabled;
+    uint8_t i;
 
-    int8_t newQuadrature = quadrature;
-    currentOscFreq = newOscFreq = clockFreq[currentClock];
-    bCurrentClockEnabled = bNewClockEnabled = bClockEnabled[currentClock];
+    xtalFreq = xtal;
+#ifdef ENABLE_TEMP_COMP
+    oscSetXtalFrequency( xtal + xtalCorrection );
+#else
+    oscSetXtalFrequency( xtal );
+#endif
 
-    uint32_t change = pgm_read_dword(&pCursorTransitions[cursorIndex].freqChange);
+#ifdef ENABLE_OSC_CACHE
+    memset( oscFreq, 0, sizeof( oscFreq ) );
+#endif
+    for( i = 0 ; i < NUM_CLOCKS ; i++ )
+    {
+        setFrequency( i, clockFreq[i], quadrature );
+    }
+}
+#endif
 
-    enum eMode newMode = currentMode;
-#ifdef DISPLAY_BAND
-    uint8_t newBand = currentBand;
+#ifdef ENABLE_TEMP_COMP
+// Correct the crystal frequency for the chip temperature. Only called
+// when the rotary control is idle. The measurement is started on one
+// call and read on a later one so we never wait for the ADC.
+// The oscillator driver can only apply a new crystal frequency by
+// setting every clock again, which resets the PLLs and glitches the
+// outputs, so this is never done while transmitting.
+static void tempCompensate()
+{
+    int8_t temp;
+    int32_t correction;
+
+#ifdef ENABLE_RIT
+    if( bTransmit )
+    {
+        bTempMeasuring = false;
+        return;
+    }
 #endif
 
-    if( bCW )
+#ifdef ENABLE_COUNTER
+    // Don't disturb the frequency counter or calibration
+    if( currentClock == COUNTER_PAGE )
     {
-        // The leftmost digit is the control digit which allows
-        // us to turn the clock on/off and select quadrature
-        // mode on clock 1
-        if( change == CONTROL_CHARACTER )
+        return;
+    }
+#endif
+
+#ifdef ENABLE_MEMORIES
+    // The scanner is using the ADC. Start again once it has finished.
+    if( currentMemory == MEMORY_SCAN )
+    {
+        bTempMeasuring = false;
+        return;
+    }
+#endif
+
+    if( !bTempMeasuring )
+    {
+        if( (millis() - tempCompTime) >= TEMP_COMP_TIME )
         {
-            // Clock 1 cycles off->on->-90->+90->off
-            if( currentClock == 1 )
-            {
-                if( !bCurrentClockEnabled )
-                {
-                    bNewClockEnabled = true;
-                    newQuadrature = 0;
-                }
-                else
-                {
-                    if( quadrature == 0 )
-                    {
-                        newQuadrature = -1;
-                    }
-                    else if( quadrature == -1 )
-                    {
-                        newQuadrature = +1;
-                    }
-                    else
-                    {
-                        bNewClockEnabled = false;
-                    }
-                }
-            }
-            else
-            {
-                // Clock 0 and 2 cycle on->off
-                bNewClockEnabled = !bCurrentClockEnabled;
-            }
+            ioTempStart();
+            bTempMeasuring = true;
         }
-        else if( change == CHANGE_MODE )
+    }
+    else if( ioTempRead( &temp ) )
+    {
+        bTempMeasuring = false;
+        tempCompTime = millis();
+
+        // Ignore changes of a degree either way so the outputs don't
+        // jump back and forth when on the edge of two readings
+        if( abs( temp - xtalCorrectionTemp ) > TEMP_COMP_HYSTERESIS )
         {
-            newMode++;
-            if( newMode >= NUM_MODES )
+            xtalCorrectionTemp = temp;
+
+            // The crystal's error in ppb scaled to Hz. The product
+            // overflows 32 bits beyond about 86ppm so use 64 bits
+            // as calibrate() does.
+            correction = ((int64_t) xtalFreq * nvramReadTempComp( temp )) / 1000000000;
+            if( correction != xtalCorrection )
             {
-                newMode = 0;
+                xtalCorrection = correction;
+                setXtalFrequency( xtalFreq );
             }
         }
-#ifdef DISPLAY_BAND
-        else if( change == CHANGE_BAND )
+    }
+}
+#endif
+
+#ifdef ENABLE_CALIBRATION
+// Start or stop calibration
+static void startCalibration( bool bStart )
+{
+    bCalibrating = bStart;
+    calSteps = 0;
+    calMeasurements = 0;
+    calInCycles = calInTicks = calRefCycles = calRefTicks = 0;
+}
+
+// Add a frequency counter measurement of the calibration reference.
+// After enough measurements work out the crystal frequency that
+// would make the reference measure exactly CAL_REF_FREQ. As the
+// measured frequency is proportional to the crystal frequency we
+// can go straight there rather than searching for it. The next
+// step then checks the result.
+static void calibrate( uint16_t inCycles, uint32_t inTicks, uint16_t refCycles, uint32_t refTicks )
+{
+    calInCycles += inCycles;
+    calInTicks += inTicks;
+    calRefCycles += refCycles;
+    calRefTicks += refTicks;
+
+    if( ++calMeasurements >= CAL_MEASUREMENTS )
+    {
+        // The measured reference frequency is
+        // COUNTER_REF_FREQ * (calInCycles * calRefTicks) / (calInTicks * calRefCycles)
+        // and it is proportional to the crystal frequency we have told the
+        // oscillator, so the crystal frequency needs scaling by the ratio
+        // of CAL_REF_FREQ to this. Work with the difference, scaled down
+        // by 4096, to stay within 64 bits.
+        int64_t measured = ((uint64_t) calInCycles * calRefTicks * COUNTER_REF_FREQ) / 4096;
+        int64_t expected = ((uint64_t) calInTicks * calRefCycles * CAL_REF_FREQ) / 4096;
+        int32_t correction = ((int64_t) xtalFreq * (expected - measured)) / measured;
+        uint32_t newXtalFreq = xtalFreq + correction;
+
+        calSteps++;
+
+        if( (newXtalFreq < MIN_XTAL_FREQUENCY) || (newXtalFreq > MAX_XTAL_FREQUENCY) || (calSteps > CAL_MAX_STEPS) )
         {
-            newBand++;
-            if( newBand > NUM_BANDS )
-            {
-                newBand = 0;
-            }
+            // Something is wrong e.g. no reference so give up
+            startCalibration( false );
+        }
+        else if( labs( correction ) <= CAL_THRESHOLD )
+        {
+            // Close enough so save it
+            nvramWriteXtalFreq( xtalFreq );
+            startCalibration( false );
+        }
+        else
+        {
+            // Try the new crystal frequency. Restart the counter so
+            // that the next measurements are all made with it.
+            setXtalFrequency( newXtalFreq );
+            calMeasurements = 0;
+            calInCycles = calInTicks = calRefCycles = calRefTicks = 0;
+            enableCounter( true );
+        }
+    }
+}
+#endif
+
+// When the button is pressed we move to the next digit to change
+static void nextFreqChangeDigit()
+{
+    cursorIndex++;
+    if( pgm_read_byte(&pCursorTransitions[cursorIndex].x) == CURSOR_TRANSITION_END )
+    {
+        cursorIndex = 0;
+    }
+}
+
+#ifdef ENABLE_MEMORIES
+// Get a memory channel's frequency and mode. Returns false if it
+// has never been stored.
+static bool readMemory( uint8_t channel, uint32_t *pFreq, enum eMode *pMode )
+{
+    return nvramReadMemory( channel, pFreq, pMode ) &&
+           (*pFreq >= MIN_FREQUENCY) && (*pFreq <= MAX_FREQUENCY);
+}
+
+// Recall the selected memory channel or start scanning from the
+// channel the scanner was last on
+static void recallMemory()
+{
+    uint32_t f;
+    enum eMode mode;
+
+    currentMemory = memorySelection;
+    if( currentMemory == MEMORY_SCAN )
+    {
+        scanTime = millis();
+        bScanSampling = false;
+    }
+    else
+    {
+        scanChannel = currentMemory;
+        if( readMemory( currentMemory, &f, &mode ) )
+        {
+            currentMode = mode;
+            clockFreq[0] = f;
+            setFrequency( 0, f, quadrature );
+        }
+    }
+    bUpdateDisplay = true;
+}
+
+// While scanning wait on each channel for the receiver to settle and
+// then measure the detector. Stay on the channel while there is a
+// signal, otherwise move on to the next stored channel. The ADC is
+// started on one pass and read on a later one so we never wait for it.
+static void scanMemories()
+{
+    uint16_t level;
+    uint32_t f;
+    enum eMode mode;
+    uint8_t i;
+
+    if( !bScanSampling )
+    {
+        if( (millis() - scanTime) >= MEMORY_SCAN_DWELL )
+        {
+            ioDetectorStart();
+            bScanSampling = true;
+        }
+    }
+    else if( ioDetectorRead( &level ) )
+    {
+        bScanSampling = false;
+        scanTime = millis();
+
+        if( level < MEMORY_SCAN_SQUELCH )
+        {
+            for( i = 0 ; i < NUM_MEMORIES ; i++ )
+            {
+                scanChannel = (scanChannel + 1) % NUM_MEMORIES;
+                if( readMemory( scanChannel, &f, &mode ) )
+                {
+                    currentMode = mode;
+                    clockFreq[0] = f;
+                    setFrequency( 0, f, quadrature );
+                    bUpdateDisplay = true;
+                    break;
+                }
+            }
+        }
+    }
+}
+#endif
+
+// Handle the rotary control while in the standard clock generator mode
+static void handleRotary( bool bCW, bool bCCW, bool bShortPress, bool bLongPress )
+{
+    uint32_t currentOscFreq, newOscFreq;
+    bool bCurrentClockEnabled, bNewClockEnabled;
+
+    if( bCW || bCCW )
+    {
+        DIAG_COUNT(encoderEvents);
+    }
+
+#ifdef ENABLE_DIAGNOSTICS
+    // On the diagnostics page turn to scroll through the counters,
+    // short press to clear them and long press to go back to clock 0
+    if( currentClock == DIAG_PAGE )
+    {
+        if( bCW )
+        {
+            diagPage++;
+            if( diagPage >= DIAG_NUM_PAGES )
+            {
+                diagPage = 0;
+            }
+        }
+        else if( bCCW )
+        {
+            if( diagPage == 0 )
+            {
+                diagPage = DIAG_NUM_PAGES;
+            }
+            diagPage--;
+        }
+        else if( bShortPress )
+        {
+#ifdef ENABLE_TRACE
+            bDiagResetPending = true;
+            diagResetTime = millis();
+#else
+            diagReset();
+#endif
+        }
+        else if( bLongPress )
+        {
+            currentClock = 0;
+            cursorIndex = 0;
+        }
+        bUpdateDisplay = true;
+        return;
+    }
+#endif
+
+#ifdef ENABLE_COUNTER
+    // On the counter page all we can do is a long press to go
+    // on to the next page or a short press to calibrate
+    if( currentClock == COUNTER_PAGE )
+    {
+        if( bCW || bCCW )
+        {
+            DIAG_COUNT(encoderDropped);
+        }
+#ifdef ENABLE_CALIBRATION
+        if( bShortPress )
+        {
+            startCalibration( !bCalibrating );
+            bUpdateDisplay = true;
+        }
+#endif
+        if( bLongPress )
+        {
+#ifdef ENABLE_CALIBRATION
+            startCalibration( false );
+#endif
+            enableCounter( false );
+#ifdef ENABLE_DIAGNOSTICS
+            currentClock = DIAG_PAGE;
+            diagPage = 0;
+#else
+            currentClock = 0;
+            cursorIndex = 0;
+#endif
+            bUpdateDisplay = true;
+        }
+        return;
+    }
+#endif
+
+    uint32_t change = pgm_read_dword(&pCursorTransitions[cursorIndex].freqChange);
+
+#ifdef ENABLE_MEMORIES
+    // Using the rotary control for anything but the memory channel
+    // stops the scan on the current channel
+    if( (currentMemory == MEMORY_SCAN) &&
+        !(bSettingMode && (bCW || bCCW) && (change == CHANGE_MEMORY)) )
+    {
+        currentMemory = scanChannel;
+        if( memorySelection == MEMORY_SCAN )
+        {
+            memorySelection = scanChannel;
+        }
+        bUpdateDisplay = true;
+    }
+#endif
+
+    int8_t newQuadrature = quadrature;
+    currentOscFreq = newOscFreq = clockFreq[currentClock];
+    bCurrentClockEnabled = bNewClockEnabled = bClockEnabled[currentClock];
+
+    enum eMode newMode = currentMode;
+#ifdef DISPLAY_BAND
+    uint8_t newBand = currentBand;
+#endif
+#ifdef ENABLE_RIT
+    enum eOffsetMode newOffsetMode = offsetMode;
+    int16_t newOffset = offset;
+#endif
+#ifdef ENABLE_MEMORIES
+    uint8_t newMemory = memorySelection;
+#endif
+
+    if( bCW )
+    {
+        // The leftmost digit is the control digit which allows
+        // us to turn the clock on/off and select quadrature
+        // mode on clock 1
+        if( change == CONTROL_CHARACTER )
+        {
+            // Clock 1 cycles off->on->-90->+90->off
+            if( currentClock == 1 )
+            {
+                if( !bCurrentClockEnabled )
+                {
+                    bNewClockEnabled = true;
+                    newQuadrature = 0;
+                }
+                else
+                {
+                    if( quadrature == 0 )
+                    {
+                        newQuadrature = -1;
+                    }
+                    else if( quadrature == -1 )
+                    {
+                        newQuadrature = +1;
+                    }
+                    else
+                    {
+                        bNewClockEnabled = false;
+                    }
+                }
+            }
+            else
+            {
+                // Clock 0 and 2 cycle on->off
+                bNewClockEnabled = !bCurrentClockEnabled;
+            }
+        }
+        else if( change == CHANGE_MODE )
+        {
+            newMode++;
+            if( newMode >= NUM_MODES )
+            {
+                newMode = 0;
+            }
+        }
+#ifdef ENABLE_RIT
+        else if( change == CHANGE_OFFSET )
+        {
+            newOffsetMode++;
+            if( newOffsetMode >= NUM_OFFSET_MODES )
+            {
+                newOffsetMode = 0;
+            }
+        }
+        else if( bOffsetSetting && (offsetMode != OFFSET_SPLIT) )
+        {
+            newOffset += change;
+        }
+#endif
+#ifdef DISPLAY_BAND
+        else if( change == CHANGE_BAND )
+        {
+            newBand++;
+            if( newBand > NUM_BANDS )
+            {
+                newBand = 0;
+            }
+        }
+#endif
+#ifdef ENABLE_MEMORIES
+        else if( change == CHANGE_MEMORY )
+        {
+            // After the last channel comes the scan
+            newMemory++;
+            if( newMemory > MEMORY_SCAN )
+            {
+                newMemory = 0;
+            }
         }
 #endif
         else
@@ -568,6 +1274,23 @@ static void handleRotary( bool bCW, bool bCCW, bool bShortPress, bool bLongPress
                 newMode--;
             }
         }
+#ifdef ENABLE_RIT
+        else if( change == CHANGE_OFFSET )
+        {
+            if( newOffsetMode == 0 )
+            {
+                newOffsetMode = NUM_OFFSET_MODES - 1;
+            }
+            else
+            {
+                newOffsetMode--;
+            }
+        }
+        else if( bOffsetSetting && (offsetMode != OFFSET_SPLIT) )
+        {
+            newOffset -= change;
+        }
+#endif
 #ifdef DISPLAY_BAND
         else if( change == CHANGE_BAND )
         {
@@ -580,6 +1303,19 @@ static void handleRotary( bool bCW, bool bCCW, bool bShortPress, bool bLongPress
                 newBand--;
             }
         }
+#endif
+#ifdef ENABLE_MEMORIES
+        else if( change == CHANGE_MEMORY )
+        {
+            if( newMemory == 0 )
+            {
+                newMemory = MEMORY_SCAN;
+            }
+            else
+            {
+                newMemory--;
+            }
+        }
 #endif
         else
         {
@@ -588,6 +1324,14 @@ static void handleRotary( bool bCW, bool bCCW, bool bShortPress, bool bLongPress
     }
     else if( bShortPress )
     {
+#ifdef ENABLE_MEMORIES
+        // On the memory channel it also recalls the selected channel
+        if( change == CHANGE_MEMORY )
+        {
+            bMemoryRecallPending = true;
+            memoryRecallTime = millis();
+        }
+#endif
         // Short press moves to the next digit
         nextFreqChangeDigit();
         bUpdateDisplay = true;
@@ -600,6 +1344,14 @@ static void handleRotary( bool bCW, bool bCCW, bool bShortPress, bool bLongPress
             if( bSettingMode )
             {
                 bSettingMode = false;
+#ifdef ENABLE_RIT
+                // Then moves on to setting the offset
+                bOffsetSetting = true;
+            }
+            else if( bOffsetSetting )
+            {
+                bOffsetSetting = false;
+#endif
                 pCursorTransitions = vfoCursorTransition;
             }
             else
@@ -610,7 +1362,25 @@ static void handleRotary( bool bCW, bool bCCW, bool bShortPress, bool bLongPress
 
             // Always start at the beginning of the new transition list
             cursorIndex = 0;
+
+#ifdef ENABLE_RIT
+            // The offset has its own transitions depending on the
+            // offset mode
+            currentClock = 0;
+            if( bOffsetSetting )
+            {
+                setOffsetCursor();
+            }
+#endif
+        }
+#ifdef ENABLE_COUNTER
+        else if( currentClock == (NUM_CLOCKS-1) )
+        {
+            // Long press from the last clock moves to the frequency counter
+            currentClock = COUNTER_PAGE;
+            enableCounter( true );
         }
+#endif
         else
         {
             // Long press moves to the next clock
@@ -635,7 +1405,7 @@ static void handleRotary( bool bCW, bool bCCW, bool bShortPress, bool bLongPress
         // Enable or disable the clock if its state has changed
         if( bNewClockEnabled != bCurrentClockEnabled )
         {
-            oscClockEnable( currentClock, bNewClockEnabled );
+            enableOscClock( currentClock, bNewClockEnabled );
             bClockEnabled[currentClock] = bNewClockEnabled;
             bUpdateDisplay = true;
         }
@@ -645,10 +1415,59 @@ static void handleRotary( bool bCW, bool bCCW, bool bShortPress, bool bLongPress
         if ( newBand != currentBand )
         {
             currentBand = newBand;
+#ifdef ENABLE_BAND_STACK
+            // Go back to the last frequency and mode used on the band
+            if( currentBand != OUT_OF_BAND )
+            {
+                newOscFreq = bandStack[currentBand - 1].freq;
+                newMode = bandStack[currentBand - 1].mode;
+            }
+            else
+#endif
             newOscFreq = pgm_read_dword(&band[newBand].defaultFreq);
         }
 #endif
 
+#ifdef ENABLE_MEMORIES
+        // Only show the new memory channel. It isn't recalled until a
+        // press.
+        if( newMemory != memorySelection )
+        {
+            memorySelection = newMemory;
+            bUpdateDisplay = true;
+        }
+#endif
+
+#ifdef ENABLE_RIT
+        // Apply a new offset or offset mode
+        if( (newOffset != offset) || (newOffsetMode != offsetMode) )
+        {
+            if( (newOffset >= -MAX_RIT_OFFSET) && (newOffset <= MAX_RIT_OFFSET) )
+            {
+                offset = newOffset;
+            }
+            else
+            {
+                // Turned past the end of the offset range
+                DIAG_COUNT(encoderDropped);
+            }
+
+            if( newOffsetMode != offsetMode )
+            {
+                // Split starts with VFO B on the same frequency as VFO A
+                if( newOffsetMode == OFFSET_SPLIT )
+                {
+                    clockFreq[1] = clockFreq[0];
+                }
+                offsetMode = newOffsetMode;
+                setOffsetCursor();
+            }
+
+            setFrequency( 0, clockFreq[0], 0 );
+            bUpdateDisplay = true;
+        }
+#endif
+
         // Only set frequency or quadrature if it has changed
         if( (newOscFreq != currentOscFreq) || (newQuadrature != quadrature) || (newMode != currentMode) )
         {
@@ -663,6 +1482,11 @@ static void handleRotary( bool bCW, bool bCCW, bool bShortPress, bool bLongPress
 
                 bUpdateDisplay = true;
             }
+            else
+            {
+                // Turned past the end of the frequency range
+                DIAG_COUNT(encoderDropped);
+            }
         }
     }
 }
@@ -670,15 +1494,44 @@ static void handleRotary( bool bCW, bool bCCW, bool bShortPress, bool bLongPress
 // Display the cursor on the frequency digit currently being changed
 static void updateCursor()
 {
+#ifdef ENABLE_RIT
+    // In setting mode or setting the offset make the cursor blink
+    enum eCursorState cursorType = (bSettingMode || bOffsetSetting) ? cursorBlink : cursorUnderline;
+#else
     // In setting mode make the cursor blink
     enum eCursorState cursorType = bSettingMode ? cursorBlink : cursorUnderline;
+#endif
 
+#ifdef ENABLE_COUNTER
+    // The counter and diagnostics pages have no digits to change
+    // so put the cursor on the colon
+    if( currentClock >= COUNTER_PAGE )
+    {
+#ifdef ENABLE_DIAGNOSTICS
+        // In VFO mode there is no colon so hide the cursor
+        if( bVfoMode )
+        {
+            displayCursor( 0, 0, cursorNone );
+            return;
+        }
+#endif
+        cursorIndex = CONTROL_CHARACTER_INDEX;
+    }
+    else
+#endif
     // If the clock is off then go straight to the control character
     // to make it easy to turn back on
-    if( !bClockEnabled[currentClock] )
+    if( !bVfoMode && !bClockEnabled[currentClock] )
     {
         cursorIndex = CONTROL_CHARACTER_INDEX;
     }
+#ifdef ENABLE_RIT
+    // Likewise if there is no offset go to the offset mode
+    else if( bOffsetSetting && (offsetMode == OFFSET_NONE) )
+    {
+        cursorIndex = OFFSET_CONTROL_INDEX;
+    }
+#endif
     displayCursor( pgm_read_byte(&pCursorTransitions[cursorIndex].x), pgm_read_byte(&pCursorTransitions[cursorIndex].y), cursorType );
 }
 
@@ -690,6 +1543,14 @@ static void updateDisplay()
     uint8_t i;
     char buf[LCD_WIDTH+1];
 
+#ifdef ENABLE_DIAGNOSTICS
+    if( currentClock == DIAG_PAGE )
+    {
+        diagDisplay( diagPage );
+        return;
+    }
+#endif
+
     if( bVfoMode )
     {
 #ifdef DISPLAY_BAND
@@ -700,10 +1561,52 @@ static void updateDisplay()
 #else
         strcpy_P( buf, modeText[currentMode] );
 #endif
+
+#ifdef ENABLE_RIT
+        // Show any offset at the right hand end
+        i = strlen( buf );
+        memset( &buf[i], ' ', LCD_WIDTH - i );
+        buf[LCD_WIDTH] = '\0';
+
+        if( offsetMode == OFFSET_SPLIT )
+        {
+            strcpy_P( &buf[OFFSET_X], PSTR("SPLIT") );
+        }
+        else if( offsetMode != OFFSET_NONE )
+        {
+            uint16_t n = abs( offset );
+
+            buf[OFFSET_X] = (offsetMode == OFFSET_RIT) ? 'R' : 'X';
+            buf[OFFSET_X+1] = (offset < 0) ? '-' : '+';
+            for( i = OFFSET_X+5 ; i > OFFSET_X+1 ; i-- )
+            {
+                buf[i] = (n % 10) + '0';
+                n /= 10;
+            }
+        }
+#endif
         displayText( 0, buf, true );
 
         // On the second line display the frequency
+#ifdef ENABLE_RIT
+        // When transmitting this is the TX frequency.
+        // When setting split it is VFO B.
+        convertNumber( buf, LCD_WIDTH, bTransmit ? vfoFrequency() : clockFreq[currentClock], false, true );
+#else
         convertNumber( buf, LCD_WIDTH, clockFreq[0], false, true );
+#endif
+#ifdef ENABLE_MEMORIES
+        // In setting mode or while scanning show the memory channel
+        // at the right hand end, M for a channel or S when scanning
+        if( bSettingMode || (currentMemory == MEMORY_SCAN) )
+        {
+            i = strlen( buf );
+            memset( &buf[i], ' ', LCD_WIDTH - i );
+            buf[LCD_WIDTH] = '\0';
+            buf[MEMORY_X] = (memorySelection == MEMORY_SCAN) ? 'S' : 'M';
+            buf[MEMORY_X+1] = '1' + ((memorySelection == MEMORY_SCAN) ? scanChannel : memorySelection);
+        }
+#endif
         displayText( 1, buf, true );
     }
     else
@@ -745,6 +1648,50 @@ static void updateDisplay()
         buf[2] = 'K';
         buf[3] = currentClock + '0';
 
+#ifdef ENABLE_COUNTER
+        // On the counter page display the measured frequency
+        if( currentClock == COUNTER_PAGE )
+        {
+            buf[1] = 'N';
+            buf[2] = 'T';
+            buf[3] = ' ';
+            buf[4] = ':';
+            if( counterFreq == COUNTER_OVER_RANGE )
+            {
+                memcpy_P( &buf[6], PSTR("Over range"), 10 );
+            }
+            else if( counterFreq == 0 )
+            {
+                // Nothing measured so show the range of inputs that can be
+                convertNumber( &buf[7], LCD_WIDTH-7, COUNTER_MAX_FREQUENCY, false, false );
+                convertNumber( &buf[1], 9, COUNTER_MIN_FREQUENCY, false, false );
+                memcpy_P( &buf[1], PSTR("NT :"), 4 );
+                buf[10] = '-';
+            }
+            else
+            {
+                convertNumber( &buf[7], LCD_WIDTH-7, counterFreq, false, false );
+            }
+
+#ifdef ENABLE_CALIBRATION
+            // When calibrating display the reference frequency needed
+            // until it is measured, then the crystal frequency
+            if( bCalibrating && (counterFreq == 0) )
+            {
+                memcpy_P( buf, PSTR("REF :"), 5 );
+                convertNumber( &buf[7], LCD_WIDTH-7, CAL_REF_FREQ, false, false );
+            }
+            else if( bCalibrating )
+            {
+                buf[0] = 'X';
+                buf[1] = 'T';
+                buf[2] = 'L';
+                convertNumber( &buf[7], LCD_WIDTH-7, xtalFreq, false, false );
+            }
+#endif
+        }
+        else
+#endif
         // If the clock is off then display a dot
         if( !bClockEnabled[currentClock] )
         {
@@ -776,6 +1723,140 @@ static void updateDisplay()
 }
 
 // Main loop
+#ifdef ENABLE_BAND_STACK
+// Write the band stacking registers to EEPROM with one page write
+static void saveBandStack()
+{
+    uint8_t i;
+
+    bBandStackDirty = false;
+    for( i = 0 ; i < NUM_BANDS ; i++ )
+    {
+        nvramWriteBandStack( i, bandStack[i].freq, bandStack[i].mode );
+    }
+    nvramSaveBandStack();
+}
+#endif
+
+#ifdef ENABLE_POWER_FAIL_SAVE
+// Called from the voltage level monitor interrupt as soon as the
+// supply starts to fail, so it doesn't wait for a display update or
+// an EEPROM write in the main loop. Save the state and then do nothing
+// else until the power goes. Carry on if it was just a dip. The save
+// is at most one user row page write and one EEPROM page write, about
+// 8ms.
+void powerFailSave()
+{
+    nvramWritePowerFail( clockFreq, bClockEnabled, quadrature, currentMode );
+#ifdef ENABLE_BAND_STACK
+    if( bBandStackDirty )
+    {
+        saveBandStack();
+    }
+#endif
+    while( ioPowerFailing() );
+}
+#endif
+
+#ifdef ENABLE_WARM_RESTART
+// A copy of the live state in RAM that isn't cleared at reset. After
+// a reset that wasn't a power on, e.g. watchdog or brown-out, it is
+// used to restore the outputs before anything else. The checksum
+// catches RAM that has been corrupted or was never set.
+#define WARM_STATE_SEED 0x5351
+static struct
+{
+    uint32_t xtalFreq;
+    uint32_t clockFreq[NUM_CLOCKS];
+    bool bClockEnabled[NUM_CLOCKS];
+    int8_t quadrature;
+    enum eMode mode;
+    bool bVfo;
+#ifdef ENABLE_RIT
+    enum eOffsetMode offsetMode;
+    int16_t offset;
+#endif
+    uint16_t checksum;
+}
+warmState __attribute__ ((section (".noinit")));
+
+static uint16_t warmStateChecksum()
+{
+    uint16_t sum = WARM_STATE_SEED;
+    uint8_t i;
+
+    for( i = 0 ; i < sizeof( warmState ) - sizeof( warmState.checksum ) ; i++ )
+    {
+        sum = (sum << 1) + (sum >> 15) + ((uint8_t *) &warmState)[i];
+    }
+
+    return sum;
+}
+
+// Save the state whenever it changes
+static void saveWarmState()
+{
+    uint8_t i;
+
+    warmState.xtalFreq = xtalFreq;
+    for( i = 0 ; i < NUM_CLOCKS ; i++ )
+    {
+        warmState.clockFreq[i] = clockFreq[i];
+        warmState.bClockEnabled[i] = bClockEnabled[i];
+    }
+    warmState.quadrature = quadrature;
+    warmState.mode = currentMode;
+    warmState.bVfo = bVfoMode;
+#ifdef ENABLE_RIT
+    warmState.offsetMode = offsetMode;
+    warmState.offset = offset;
+#endif
+    warmState.checksum = warmStateChecksum();
+}
+
+// If the saved state is valid put the oscillator back to it and
+// return true. A brown-out deep enough to reset us may have reset
+// the oscillator chip too so it is always initialised again.
+static bool restoreWarmState()
+{
+    uint8_t i;
+
+    if( warmState.checksum != warmStateChecksum() )
+    {
+        return false;
+    }
+
+    xtalFreq = warmState.xtalFreq;
+    for( i = 0 ; i < NUM_CLOCKS ; i++ )
+    {
+        clockFreq[i] = warmState.clockFreq[i];
+        bClockEnabled[i] = warmState.bClockEnabled[i];
+    }
+    quadrature = warmState.quadrature;
+    currentMode = warmState.mode;
+#ifndef FIXED_VFO_MODE
+    bVfoMode = warmState.bVfo;
+#endif
+#ifdef ENABLE_RIT
+    offsetMode = warmState.offsetMode;
+    offset = warmState.offset;
+#endif
+
+    oscInit();
+    oscSetXtalFrequency( xtalFreq );
+    for( i = 0 ; i < NUM_CLOCKS ; i++ )
+    {
+        setFrequency( i, clockFreq[i], quadrature );
+        enableOscClock( i, bClockEnabled[i] );
+    }
+
+    return true;
+}
+#else
+// Always a cold start
+#define bWarmRestart false
+#endif
+
 static void loop()
 {
     bool bShortPress;
@@ -783,26 +1864,277 @@ static void loop()
     bool bCW;
     bool bCCW;
 
+    DIAG_LOOP();
     bUpdateDisplay = false;
 
+#ifdef ENABLE_RIT
+    // Retune for RX or TX as soon as the PTT changes
+    if( bVfoMode && (ioReadPTT() != bTransmit) )
+    {
+        bTransmit = !bTransmit;
+        setFrequency( 0, clockFreq[0], 0 );
+        bUpdateDisplay = true;
+    }
+#endif
+
+#ifdef ENABLE_COUNTER
+    // Display each new frequency counter measurement
+    if( currentClock == COUNTER_PAGE )
+    {
+        uint16_t inCycles, refCycles;
+        uint32_t inTicks, refTicks;
+
+        if( ioCounterRead( &inCycles, &inTicks, &refCycles, &refTicks ) )
+        {
+            // The input frequency is the reference frequency scaled by the
+            // ratio of the two measurements. Round to the nearest Hz.
+            uint64_t divisor = (uint64_t) inTicks * refCycles;
+            counterFreq = ((uint64_t) COUNTER_REF_FREQ * inCycles * refTicks + divisor / 2) / divisor;
+            counterTime = millis();
+            bUpdateDisplay = true;
+
+#ifdef ENABLE_CALIBRATION
+            if( bCalibrating )
+            {
+                calibrate( inCycles, inTicks, refCycles, refTicks );
+            }
+#endif
+        }
+        else if( ioCounterOverRange() )
+        {
+            if( counterFreq != COUNTER_OVER_RANGE )
+            {
+                counterFreq = COUNTER_OVER_RANGE;
+                counterTime = millis();
+                bUpdateDisplay = true;
+            }
+            else if( (millis() - counterTime) > COUNTER_TIMEOUT )
+            {
+                // See if the input has come back into range
+                counterTime = millis();
+                ioCounterEnable( true );
+            }
+        }
+        else if( counterFreq && ((millis() - counterTime) > COUNTER_TIMEOUT) )
+        {
+            counterFreq = 0;
+            bUpdateDisplay = true;
+        }
+    }
+#endif
+
+#ifdef ENABLE_MEMORIES
+    if( bMemoryRecallPending && ((millis() - memoryRecallTime) >= BUTTON_DOUBLE_CLICK_TIME) )
+    {
+        bMemoryRecallPending = false;
+        recallMemory();
+    }
+
+    if( bVfoMode && (currentMemory == MEMORY_SCAN) )
+    {
+        scanMemories();
+    }
+#endif
+
+#ifdef ENABLE_DIAGNOSTICS
+    // Keep the diagnostics page up to date
+    if( (currentClock == DIAG_PAGE) && ((millis() - diagTime) >= DIAG_UPDATE_TIME) )
+    {
+        diagTime = millis();
+        bUpdateDisplay = true;
+    }
+
+#ifdef ENABLE_TRACE
+    if( bDiagResetPending && ((millis() - diagResetTime) >= BUTTON_DOUBLE_CLICK_TIME) )
+    {
+        bDiagResetPending = false;
+        diagReset();
+        bUpdateDisplay = true;
+    }
+#endif
+#endif
+
+#ifdef ENABLE_GESTURES
+    // Only the rotation comes from the rotary library. The switch
+    // is handled by the gesture recogniser.
+    enum eButtonEvent buttonEvent;
+    readRotary(&bCW, &bCCW, &bShortPress, &bLongPress);
+    bool bHeld = buttonRead( &buttonEvent );
+    bShortPress = (buttonEvent == buttonShortPress);
+    bLongPress = (buttonEvent == buttonLongPress);
+#ifdef ENABLE_MEMORIES
+    if( bShortPress )
+    {
+        clickCursorIndex = cursorIndex;
+    }
+#endif
+
+    if( bHeld && (bCW || bCCW) )
+    {
+        // Turning while the switch is held is the same as a long
+        // press without having to wait for it
+        buttonCancel();
+        bCW = bCCW = false;
+        bLongPress = true;
+    }
+    else if( buttonEvent == buttonDoubleClick )
+    {
+        // In the clock generator a double click jumps straight to
+        // the control character. Elsewhere it is just another click.
+        if( !bVfoMode && (currentClock < NUM_CLOCKS) )
+        {
+            cursorIndex = CONTROL_CHARACTER_INDEX;
+            bUpdateDisplay = true;
+        }
+#ifdef ENABLE_TRACE
+        // On the diagnostics page it sends the trace out of the serial port
+        else if( currentClock == DIAG_PAGE )
+        {
+            bDiagResetPending = false;
+            traceDump();
+        }
+#endif
+#ifdef ENABLE_MEMORIES
+        // On a memory channel it stores the current frequency and mode
+        // and puts the cursor back where the first click found it
+        else if( bVfoMode && bSettingMode && (memorySelection < NUM_MEMORIES) &&
+                 (pgm_read_dword(&pCursorTransitions[clickCursorIndex].freqChange) == CHANGE_MEMORY) )
+        {
+            // The first click mustn't recall the channel we're storing
+            bMemoryRecallPending = false;
+            currentMemory = scanChannel = memorySelection;
+            nvramWriteMemory( currentMemory, clockFreq[0], currentMode );
+            cursorIndex = clickCursorIndex;
+            bUpdateDisplay = true;
+        }
+#endif
+#ifdef ENABLE_DIAGNOSTICS
+        // In VFO mode there is no counter page to reach the diagnostics
+        // from so a double click while tuning goes straight there
+        else if( bVfoMode && !bSettingMode
+#ifdef ENABLE_RIT
+                 && !bOffsetSetting
+#endif
+               )
+        {
+            currentClock = DIAG_PAGE;
+            diagPage = 0;
+            bUpdateDisplay = true;
+        }
+#endif
+        else
+        {
+            bShortPress = true;
+        }
+    }
+#else
     // Read the rotary control and its switch
     readRotary(&bCW, &bCCW, &bShortPress, &bLongPress);
+#endif
 
     if( bCW || bCCW || bShortPress || bLongPress )
     {
+        TRACE( traceRotary, (bCW ? TRACE_ROTARY_CW : 0) | (bCCW ? TRACE_ROTARY_CCW : 0) |
+                            (bShortPress ? TRACE_ROTARY_SHORT : 0) | (bLongPress ? TRACE_ROTARY_LONG : 0), 0 );
+        DIAG_EVENT_START();
         handleRotary(bCW, bCCW, bShortPress, bLongPress);
+        DIAG_EVENT_END();
     }
+#ifdef ENABLE_TEMP_COMP
+    else
+    {
+        // Only spend time on this when the rotary control is idle
+        tempCompensate();
+    }
+#endif
 
     if( bUpdateDisplay )
     {
         updateDisplay();
         updateCursor();
+        DIAG_COUNT(lcdUpdates);
+        TRACE( traceDisplay, currentClock, cursorIndex );
+#ifdef ENABLE_WARM_RESTART
+        saveWarmState();
+#endif
     }
 }
 
+#ifdef ENABLE_PROFILES
+// If the rotary control's switch is held at power up let the user
+// choose the configuration profile. Turn the control to scroll through
+// the profiles and press it to select one.
+static void selectProfile()
+{
+    bool bA, bB, bSw;
+    bool bCW, bCCW, bShortPress, bLongPress;
+    uint8_t profile;
+    uint32_t releaseTime;
+    char buf[LCD_WIDTH+1];
+
+    ioReadRotary( &bA, &bB, &bSw );
+    if( bSw )
+    {
+        profile = nvramReadProfile();
+
+        // Wait for the switch to be released and settle so the press
+        // that got us here isn't taken as the selection
+        releaseTime = millis();
+        while( (millis() - releaseTime) < (2 * ROTARY_BUTTON_DEBOUNCE_TIME) )
+        {
+            readRotary( &bCW, &bCCW, &bShortPress, &bLongPress );
+            ioReadRotary( &bA, &bB, &bSw );
+            if( bSw )
+            {
+                releaseTime = millis();
+            }
+        }
+
+        bCW = bCCW = bShortPress = bLongPress = false;
+        do
+        {
+            if( bCW )
+            {
+                profile++;
+                if( profile >= NUM_PROFILES )
+                {
+                    profile = 0;
+                }
+            }
+            else if( bCCW )
+            {
+                if( profile == 0 )
+                {
+                    profile = NUM_PROFILES;
+                }
+                profile--;
+            }
+
+            // Show the profile number and the start of its configuration
+            strcpy_P( buf, PSTR("Profile ") );
+            buf[8] = '1' + profile;
+            buf[9] = '\0';
+            displayText( 0, buf, true );
+            nvramReadProfileText( profile, buf, LCD_WIDTH );
+            displayText( 1, buf, true );
+
+            do
+            {
+                readRotary( &bCW, &bCCW, &bShortPress, &bLongPress );
+            } while( !bCW && !bCCW && !bShortPress && !bLongPress );
+        } while( !bShortPress && !bLongPress );
+
+        nvramWriteProfile( profile );
+    }
+}
+#endif
+
 int main(void)
 {
     uint8_t i;
+#ifdef ENABLE_WARM_RESTART
+    bool bWarmRestart;
+#endif
 
     // Set up the timer
     millisInit();
@@ -810,26 +2142,69 @@ int main(void)
     // Initialise the inputs and outputs
     ioInit();
 
+#ifdef ENABLE_WARM_RESTART
+    // After a warm reset put the outputs back as they were before
+    // doing the slow initialisation of the NVRAM and display
+    bWarmRestart = ioWarmReset() && restoreWarmState();
+#endif
+
+#ifdef ENABLE_PROFILES
+    // The display is needed to choose the profile before
+    // the NVRAM is read
+    displayInit();
+    if( !bWarmRestart )
+    {
+        selectProfile();
+    }
+#endif
+
     // Initialise the NVRAM
     nvramInit();
 
+#ifndef FIXED_VFO_MODE
     // Set the VFO mode early
-    bVfoMode = nvramReadVfoMode();
+    if( !bWarmRestart )
+    {
+        bVfoMode = nvramReadVfoMode();
+    }
+#endif
 
+#ifndef ENABLE_PROFILES
     // Set up the display
     displayInit();
+#endif
 
-    // Initialise the oscillator chip
-    oscInit();
+    if( !bWarmRestart )
+    {
+        // Initialise the oscillator chip
+        oscInit();
 
-    // Load the crystal frequency from NVRAM
-    oscSetXtalFrequency( nvramReadXtalFreq() );
+        // Load the crystal frequency from NVRAM
+        xtalFreq = nvramReadXtalFreq();
+        oscSetXtalFrequency( xtalFreq );
 
-    // Get the reception mode (only used in VFO mode)
-    currentMode = nvramReadRXMode();
+        // Get the reception mode (only used in VFO mode)
+        currentMode = nvramReadRXMode();
 
-    // Get the quadrature setting from NVRAM
-    quadrature = nvramReadQuadrature();
+        // Get the quadrature setting from NVRAM
+        quadrature = nvramReadQuadrature();
+    }
+
+#ifdef ENABLE_BAND_STACK
+    // Load the band stacking registers. Any that aren't valid start
+    // at the band's default frequency.
+    for( i = 0 ; i < NUM_BANDS ; i++ )
+    {
+        nvramReadBandStack( i, &bandStack[i].freq, &bandStack[i].mode );
+        if( (bandStack[i].freq < pgm_read_dword(&band[i + 1].minFreq)) ||
+            (bandStack[i].freq > pgm_read_dword(&band[i + 1].maxFreq)) ||
+            (bandStack[i].mode >= NUM_MODES) )
+        {
+            bandStack[i].freq = pgm_read_dword(&band[i + 1].defaultFreq);
+            bandStack[i].mode = currentMode;
+        }
+    }
+#endif
 
     // Set the cursor transitions for the mode
     if( bVfoMode )
@@ -841,19 +2216,22 @@ int main(void)
         pCursorTransitions = freqGenCursorTransition;
     }
 
-    // Read the frequencies and enable states from NVRAM and
-    // set the clocks accordingly
-	// Done as separate operations as may need to know other
-	// clocks when setting VFO frequencies
-    for( i = 0 ; i < NUM_CLOCKS ; i++ )
-    {
-        clockFreq[i] = nvramReadFreq( i );
-        bClockEnabled[i] = nvramReadClockEnable( i );
-	}
-    for( i = 0 ; i < NUM_CLOCKS ; i++ )
+    if( !bWarmRestart )
     {
-        setFrequency( i, clockFreq[i], quadrature );
-        oscClockEnable( i, bClockEnabled[i] );
+        // Read the frequencies and enable states from NVRAM and
+        // set the clocks accordingly
+        // Done as separate operations as may need to know other
+        // clocks when setting VFO frequencies
+        for( i = 0 ; i < NUM_CLOCKS ; i++ )
+        {
+            clockFreq[i] = nvramReadFreq( i );
+            bClockEnabled[i] = nvramReadClockEnable( i );
+        }
+        for( i = 0 ; i < NUM_CLOCKS ; i++ )
+        {
+            setFrequency( i, clockFreq[i], quadrature );
+            enableOscClock( i, bClockEnabled[i] );
+        }
     }
 
 #ifdef DISPLAY_BAND
@@ -861,14 +2239,22 @@ int main(void)
     currentBand = getBand( clockFreq[0] );
 #endif
 
+#ifdef ENABLE_WARM_RESTART
+    saveWarmState();
+#endif
+
     // Now show the oscillator frequencies
     updateDisplay();
     updateCursor();
 
+#ifdef ENABLE_POWER_FAIL_SAVE
+    // Everything is set up so there is now a state worth saving
+    ioPowerFailEnable();
+#endif
+
     // Main loop
     while (1) 
     {
         loop();
     }
 }
-
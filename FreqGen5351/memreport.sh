@@ -0,0 +1,33 @@
+#!/bin/sh
+# Report the RAM used by a build's .data, .bss and .noinit variables,
+# largest first, with the total for each source file.
+# Run after build.sh e.g. ./memreport.sh Release
+#
+# The build uses link time optimisation so the map file doesn't say
+# which object a variable came from. Instead each variable is matched
+# to the source file that defines it at file scope.
+CONFIG=${1:-Release}
+ELF=$CONFIG/FreqGen5351.elf
+SOURCES="*.c ../../TARL/*.c"
+
+if [ ! -f $ELF ]; then
+    echo "$ELF not found - run build.sh first"
+    exit 1
+fi
+
+echo "RAM used by $CONFIG"
+avr-size -A $ELF | grep -E '^\.(data|bss|noinit) '
+echo ''
+
+avr-nm -S --size-sort -r $ELF | awk '$3 ~ /^[bBdD]$/ { print $2, $4 }' |
+while read size symbol
+do
+    name=${symbol%%.*}
+    file=$(grep -l -E "^([A-Za-z].*[ *])?$name(\[.*\])* *(__attribute__.*)?(=.*)?[;{]?$" $SOURCES 2>/dev/null | head -1)
+    printf '%6d %-24s %s\n' 0x$size $symbol ${file:-?}
+done | tee /tmp/memreport.$$
+
+echo ''
+echo 'By source file:'
+awk '{ total[$3] += $1 } END { for( f in total ) printf "%6d %s\n", total[f], f }' /tmp/memreport.$$ | sort -rn
+rm -f /tmp/memreport.$$
@@ -13,9 +13,12 @@
 #include <avr/io.h>
 #include <avr/pgmspace.h>
 #include <ctype.h>
+#include <stddef.h>
+#include <string.h>
 
 #include "config.h"
 #include "eeprom.h"
+#include "io.h"
 #include "nvram.h"
 
 // Magic numbers used to help verify the data is correct
@@ -90,11 +93,26 @@ static bool bClockEnable[NUM_CLOCKS];
 static int8_t quadrature;
 
 // Validated VFO mode
+// In a single mode build the magic number is accepted but ignored
+#ifdef FIXED_VFO_MODE
+#define bVfoMode FIXED_VFO_MODE
+#else
 static bool bVfoMode;
+#endif
 
 // Validated RX mode i.e. CW, CWR, USB or LSB
 static enum eMode RXMode;
 
+// True if the EEPROM holds a valid configuration
+static bool bNvramValid;
+
+// EEPROM address of the selected profile's configuration
+#ifdef ENABLE_PROFILES
+static uint16_t profileAddress;
+#else
+#define profileAddress 0
+#endif
+
 // Convert n characters into a number
 static uint32_t convertNum( char *num, uint8_t n )
 {
@@ -183,6 +201,105 @@ static bool convertClockEnable( char c, bool *pbEnable, int8_t *pQuadrature, uin
     return bValid;
 }
 
+#ifdef ENABLE_POWER_FAIL_SAVE
+// The state saved in the user row when the power failed. This is used
+// in preference to the configuration if it was saved with the same
+// profile.
+#define POWER_FAIL_VALID 0xA5
+
+// Sum of the selected profile's configuration so a record saved before
+// the configuration was reprogrammed or calibrated isn't used
+static uint8_t configSum;
+
+static uint8_t profileSum()
+{
+    uint8_t i;
+    uint8_t sum = 0;
+
+    for( i = 0 ; i < sizeof( struct sNvramCache ) ; i++ )
+    {
+        sum += eepromRead( profileAddress + i );
+    }
+
+    return sum;
+}
+
+struct __attribute__ ((packed)) sPowerFailRecord
+{
+    uint8_t  valid;             // POWER_FAIL_VALID if the record is in use
+    uint8_t  profile;           // The profile in use when it was saved
+    uint8_t  configSum;         // Sum of the profile's bytes when it was saved
+    uint32_t freq[NUM_CLOCKS];  // Clock frequencies
+    uint8_t  clockEnable;       // Clock enables, one bit per clock
+    int8_t   quadrature;        // Clock 1 quadrature
+    uint8_t  mode;              // RX mode
+};
+
+// Use a valid power fail record in place of the configuration
+static void readPowerFail()
+{
+    struct sPowerFailRecord record;
+    uint8_t i;
+
+    ioReadUserRow( POWER_FAIL_USERROW_OFFSET, (uint8_t *) &record, sizeof( record ) );
+
+    if( (record.valid == POWER_FAIL_VALID) &&
+#ifdef ENABLE_PROFILES
+        (record.profile == nvramReadProfile()) &&
+#endif
+        (record.configSum == configSum) &&
+        (record.quadrature >= -1) && (record.quadrature <= 1) &&
+        (record.mode <= MODE_CWR) )
+    {
+        // Only take frequencies that are in range. The others, e.g.
+        // clock 2 at zero in VFO mode, stay as configured.
+        for( i = 0 ; i < NUM_CLOCKS ; i++ )
+        {
+            if( (record.freq[i] >= MIN_FREQUENCY) && (record.freq[i] <= MAX_FREQUENCY) )
+            {
+                freq[i] = record.freq[i];
+            }
+            bClockEnable[i] = (record.clockEnable >> i) & 1;
+        }
+        quadrature = record.quadrature;
+        RXMode = record.mode;
+    }
+}
+
+// Save the state as the power fails. The user row is only written
+// if it has changed.
+void nvramWritePowerFail( const uint32_t *pFreq, const bool *pbClockEnable, int8_t newQuadrature, enum eMode mode )
+{
+    struct sPowerFailRecord record, saved;
+    uint8_t i;
+
+    record.valid = POWER_FAIL_VALID;
+#ifdef ENABLE_PROFILES
+    record.profile = nvramReadProfile();
+#else
+    record.profile = 0;
+#endif
+    record.configSum = configSum;
+    record.clockEnable = 0;
+    for( i = 0 ; i < NUM_CLOCKS ; i++ )
+    {
+        record.freq[i] = pFreq[i];
+        if( pbClockEnable[i] )
+        {
+            record.clockEnable |= (1 << i);
+        }
+    }
+    record.quadrature = newQuadrature;
+    record.mode = mode;
+
+    ioReadUserRow( POWER_FAIL_USERROW_OFFSET, (uint8_t *) &saved, sizeof( saved ) );
+    if( memcmp( &record, &saved, sizeof( record ) ) != 0 )
+    {
+        ioWriteUserRow( POWER_FAIL_USERROW_OFFSET, (uint8_t *) &record, sizeof( record ) );
+    }
+}
+#endif
+
 // Initialise the NVRAM - read it in and check valid.
 // Must be called before any operations
 void nvramInit()
@@ -191,10 +308,15 @@ void nvramInit()
 
     bool bValid = false;
 
+#ifdef ENABLE_PROFILES
+    // Only the selected profile is read and checked
+    profileAddress = nvramReadProfile() * sizeof( struct sNvramCache );
+#endif
+
     // Read from the EEPROM into the NVRAM cache
     for( int i = 0 ; i < sizeof( nvram_cache ) ; i++ )
     {
-        ((uint8_t *) &nvram_cache)[i] = eepromRead(i);
+        ((uint8_t *) &nvram_cache)[i] = eepromRead(profileAddress + i);
     }
     
     // Check the magic numbers and spaces are correct
@@ -208,11 +330,13 @@ void nvramInit()
     {
         bValid = true;
 
+#ifndef FIXED_VFO_MODE
         // The magic number determines if we are in VFO mode
         if( nvram_cache.magic == MAGIC_VFO )
         {
             bVfoMode = true;
         }
+#endif
 
         // Get the xtal frequency and check it is within range
         xtalFreq = convertNum( nvram_cache.xtal_freq, 8 );
@@ -262,6 +386,17 @@ void nvramInit()
         }
     }
 
+    bNvramValid = bValid;
+
+#ifdef ENABLE_POWER_FAIL_SAVE
+    // The state when the power failed takes over from the configuration
+    if( bValid )
+    {
+        configSum = profileSum();
+        readPowerFail();
+    }
+#endif
+
     // If any of it wasn't valid then set the defaults
     if( !bValid )
     {
@@ -273,7 +408,9 @@ void nvramInit()
         bClockEnable[1] = DEFAULT_FREQ_0_ENABLE;
         bClockEnable[2] = DEFAULT_FREQ_0_ENABLE;
         quadrature = DEFAULT_QUADRATURE;
+#ifndef FIXED_VFO_MODE
         bVfoMode = false;
+#endif
         RXMode = MODE_CW;
     }
 }
@@ -285,6 +422,31 @@ uint32_t nvramReadXtalFreq()
     return xtalFreq;
 }
 
+// Write a new xtal frequency to the EEPROM
+// Can only do this if the EEPROM holds a valid configuration
+bool nvramWriteXtalFreq( uint32_t newXtalFreq )
+{
+    uint8_t i;
+
+    if( bNvramValid )
+    {
+        xtalFreq = newXtalFreq;
+
+        // Write the digits from the right
+        for( i = 8 ; i > 0 ; i-- )
+        {
+            eepromWrite( profileAddress + offsetof( struct sNvramCache, xtal_freq ) + i - 1, (newXtalFreq % 10) + '0' );
+            newXtalFreq /= 10;
+        }
+
+#ifdef ENABLE_POWER_FAIL_SAVE
+        configSum = profileSum();
+#endif
+    }
+
+    return bNvramValid;
+}
+
 uint32_t nvramReadFreq( uint8_t clock )
 {
     if( clock < NUM_CLOCKS )
@@ -338,3 +500,166 @@ enum eMode nvramReadRXMode()
 {
     return RXMode;
 }
+
+// Band stacking registers and memory channels are binary and stored
+// apart from the configuration. Each is 3 bytes with the frequency in
+// 10Hz units in the low 22 bits and the mode in the top 2 bits. Erased
+// memory gives a frequency above every band so the band stack caller
+// will reject it. Memory channels are not tied to a band so all ones
+// marks an empty channel and is never written.
+#define BAND_STACK_ENTRY_SIZE 3
+#define BAND_STACK_MODE_SHIFT 22
+#define BAND_STACK_ERASED ((1UL << (BAND_STACK_ENTRY_SIZE * 8)) - 1)
+
+#ifdef ENABLE_BAND_STACK
+// Band stacking registers
+
+void nvramReadBandStack( uint8_t index, uint32_t *pFreq, enum eMode *pMode )
+{
+    uint16_t address = BAND_STACK_EEPROM_ADDRESS + index * BAND_STACK_ENTRY_SIZE;
+    uint32_t entry = 0;
+    uint8_t i;
+
+    for( i = BAND_STACK_ENTRY_SIZE ; i > 0 ; i-- )
+    {
+        entry = (entry << 8) | eepromRead( address + i - 1 );
+    }
+
+    *pFreq = (entry & ((1UL << BAND_STACK_MODE_SHIFT) - 1)) * 10;
+    *pMode = entry >> BAND_STACK_MODE_SHIFT;
+}
+
+// The registers are all in one EEPROM page. Each one is loaded into
+// the page buffer and then nvramSaveBandStack() writes them with one
+// page write. This is quick enough to do as the power fails. Only the
+// bytes that have changed are loaded.
+void nvramWriteBandStack( uint8_t index, uint32_t freq, enum eMode mode )
+{
+    uint16_t address = BAND_STACK_EEPROM_ADDRESS + index * BAND_STACK_ENTRY_SIZE;
+    uint32_t entry = (freq / 10) | ((uint32_t) mode << BAND_STACK_MODE_SHIFT);
+    uint8_t i;
+
+    for( i = 0 ; i < BAND_STACK_ENTRY_SIZE ; i++ )
+    {
+        uint8_t data = entry;
+
+        if( eepromRead( address ) != data )
+        {
+            ioLoadEeprom( address, &data, 1 );
+        }
+        address++;
+        entry >>= 8;
+    }
+}
+
+void nvramSaveBandStack()
+{
+    ioWriteEepromPage();
+}
+#endif
+
+#ifdef ENABLE_MEMORIES
+// Memory channels are kept in the user row after the power fail record.
+// Returns false for an empty channel.
+bool nvramReadMemory( uint8_t index, uint32_t *pFreq, enum eMode *pMode )
+{
+    uint32_t entry = 0;
+
+    ioReadUserRow( MEMORY_USERROW_OFFSET + index * BAND_STACK_ENTRY_SIZE, (uint8_t *) &entry, BAND_STACK_ENTRY_SIZE );
+
+    *pFreq = (entry & ((1UL << BAND_STACK_MODE_SHIFT) - 1)) * 10;
+    *pMode = entry >> BAND_STACK_MODE_SHIFT;
+
+    return entry != BAND_STACK_ERASED;
+}
+
+// Returns false without writing if the frequency does not fit in an
+// entry. The largest 22 bit value is left for the empty marker.
+bool nvramWriteMemory( uint8_t index, uint32_t freq, enum eMode mode )
+{
+    uint32_t entry = (freq / 10) | ((uint32_t) mode << BAND_STACK_MODE_SHIFT);
+
+    if( (freq / 10) >= ((1UL << BAND_STACK_MODE_SHIFT) - 1) )
+    {
+        return false;
+    }
+
+    ioWriteUserRow( MEMORY_USERROW_OFFSET + index * BAND_STACK_ENTRY_SIZE, (uint8_t *) &entry, BAND_STACK_ENTRY_SIZE );
+
+    return true;
+}
+#endif
+
+#ifdef ENABLE_TEMP_COMP
+// Crystal temperature compensation curve
+//
+// 4 signed bytes giving the crystal's error in ppb as a cubic in the
+// difference from TEMP_COMP_REF_TEMP:
+//  linear coefficient in 10ppb/C
+//  quadratic coefficient in ppb/C^2
+//  cubic coefficient in 0.01ppb/C^3
+//  check byte - TEMP_COMP_CHECK plus the other three
+// If the check byte is wrong, e.g. erased EEPROM, there is no correction.
+#define TEMP_COMP_SIZE 4
+#define TEMP_COMP_CHECK 0x5A
+
+// Get the crystal's error in ppb at a temperature in C
+int32_t nvramReadTempComp( int8_t temp )
+{
+    int8_t curve[TEMP_COMP_SIZE];
+    int32_t dt = temp - TEMP_COMP_REF_TEMP;
+    uint8_t i;
+
+    for( i = 0 ; i < TEMP_COMP_SIZE ; i++ )
+    {
+        curve[i] = eepromRead( TEMP_COMP_EEPROM_ADDRESS + i );
+    }
+
+    if( (uint8_t) (TEMP_COMP_CHECK + curve[0] + curve[1] + curve[2]) != (uint8_t) curve[3] )
+    {
+        return 0;
+    }
+
+    return 10 * curve[0] * dt + curve[1] * dt * dt + (curve[2] * dt * dt * dt) / 100;
+}
+#endif
+
+#ifdef ENABLE_PROFILES
+// Configuration profiles
+//
+// There are NUM_PROFILES configurations one after another from the
+// start of the EEPROM, each in the format above. The number of the
+// one to use is stored at PROFILE_EEPROM_ADDRESS.
+
+// Get the selected profile. Erased EEPROM selects the first.
+uint8_t nvramReadProfile()
+{
+    uint8_t profile = eepromRead( PROFILE_EEPROM_ADDRESS );
+
+    return (profile < NUM_PROFILES) ? profile : 0;
+}
+
+// Select the profile to use at the next nvramInit()
+void nvramWriteProfile( uint8_t profile )
+{
+    if( profile != eepromRead( PROFILE_EEPROM_ADDRESS ) )
+    {
+        eepromWrite( PROFILE_EEPROM_ADDRESS, profile );
+    }
+}
+
+// Get the start of a profile as text so it can be shown when
+// choosing one. Anything that isn't printable is shown as '-'.
+void nvramReadProfileText( uint8_t profile, char *buf, uint8_t len )
+{
+    uint16_t address = profile * sizeof( struct sNvramCache );
+    uint8_t i;
+
+    for( i = 0 ; i < len ; i++ )
+    {
+        char c = eepromRead( address + i );
+        buf[i] = isprint(c) ? c : '-';
+    }
+    buf[len] = '\0';
+}
+#endif
@@ -15,6 +15,7 @@
 void nvramInit();
 
 uint32_t nvramReadXtalFreq();
+bool nvramWriteXtalFreq( uint32_t newXtalFreq );
 uint32_t nvramReadFreq( uint8_t clock );
 bool nvramReadClockEnable( uint8_t clock );
 bool nvramReadQuadrature();
@@ -33,4 +34,19 @@ enum eMode
 
 enum eMode nvramReadRXMode();
 
+void nvramReadBandStack( uint8_t index, uint32_t *pFreq, enum eMode *pMode );
+void nvramWriteBandStack( uint8_t index, uint32_t freq, enum eMode mode );
+void nvramSaveBandStack();
+
+void nvramWritePowerFail( const uint32_t *pFreq, const bool *pbClockEnable, int8_t newQuadrature, enum eMode mode );
+
+int32_t nvramReadTempComp( int8_t temp );
+
+bool nvramReadMemory( uint8_t index, uint32_t *pFreq, enum eMode *pMode );
+bool nvramWriteMemory( uint8_t index, uint32_t freq, enum eMode mode );
+
+uint8_t nvramReadProfile();
+void nvramWriteProfile( uint8_t profile );
+void nvramReadProfileText( uint8_t profile, char *buf, uint8_t len );
+
 #endif //NVRAM_H
@@ -0,0 +1,94 @@
+/*
+ * trace.c
+ *
+ * Records the last TRACE_LENGTH rotary control, tuning, oscillator
+ * and display events with the time they happened so that missed
+ * clicks and slow retunes seen in the field can be worked out
+ * afterwards.
+ *
+ * Created: 18/10/2026
+ */
+
+#include <inttypes.h>
+
+#include "config.h"
+#include "millis.h"
+#include "io.h"
+#include "trace.h"
+
+#ifdef ENABLE_TRACE
+
+static struct
+{
+    uint16_t time;
+    uint8_t event;
+    uint8_t param;
+    uint32_t value;
+}
+traceBuffer[TRACE_LENGTH];
+
+// Where the next event goes and whether the buffer has wrapped
+static uint8_t traceNext;
+static bool bTraceFull;
+
+void traceAdd( enum eTraceEvent event, uint8_t param, uint32_t value )
+{
+    traceBuffer[traceNext].time = millis();
+    traceBuffer[traceNext].event = event;
+    traceBuffer[traceNext].param = param;
+    traceBuffer[traceNext].value = value;
+
+    traceNext++;
+    if( traceNext == TRACE_LENGTH )
+    {
+        traceNext = 0;
+        bTraceFull = true;
+    }
+}
+
+// Send a number in decimal followed by a separator
+static void serialNumber( uint32_t n, char separator )
+{
+    char buf[10];
+    uint8_t i = 0;
+
+    do
+    {
+        buf[i++] = (n % 10) + '0';
+        n /= 10;
+    } while( n );
+
+    while( i )
+    {
+        ioSerialWrite( buf[--i] );
+    }
+    ioSerialWrite( separator );
+}
+
+void traceDump()
+{
+    uint8_t i = bTraceFull ? traceNext : 0;
+    uint8_t count = bTraceFull ? TRACE_LENGTH : traceNext;
+
+    while( count-- )
+    {
+        serialNumber( traceBuffer[i].time, ' ' );
+        ioSerialWrite( traceBuffer[i].event );
+        ioSerialWrite( ' ' );
+        serialNumber( traceBuffer[i].param, ' ' );
+        serialNumber( traceBuffer[i].value, '\r' );
+        ioSerialWrite( '\n' );
+
+        i++;
+        if( i == TRACE_LENGTH )
+        {
+            i = 0;
+        }
+    }
+
+    // Mark the end of the dump
+    ioSerialWrite( '\r' );
+    ioSerialWrite( '\n' );
+}
+
+#endif
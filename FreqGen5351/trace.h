@@ -0,0 +1,45 @@
+/*
+ * trace.h
+ *
+ * Created: 18/10/2026
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#ifdef ENABLE_TRACE
+
+// Events recorded. Each is also the character sent for it in the dump.
+enum eTraceEvent
+{
+    traceRotary = 'R',          // param is the TRACE_ROTARY_ bits
+    traceFrequency = 'F',       // setFrequency() - param is the clock
+    traceOscFrequency = 'O',    // Frequency written to the oscillator - param is the clock
+    traceOscEnable = 'E',       // Output turned on or off - param is the clock
+    traceDisplay = 'D'          // Display refreshed - param is the page and value the cursor
+};
+
+// Rotary control events
+#define TRACE_ROTARY_CW     1
+#define TRACE_ROTARY_CCW    2
+#define TRACE_ROTARY_SHORT  4
+#define TRACE_ROTARY_LONG   8
+
+#define TRACE(event, param, value) traceAdd( event, param, value )
+
+// Add an event to the trace, overwriting the oldest if it is full
+void traceAdd( enum eTraceEvent event, uint8_t param, uint32_t value );
+
+// Send the trace out of the serial port, oldest first, one event per line:
+// <ms> <event> <param> <value>
+// The time is the bottom 16 bits of the millisecond tick.
+void traceDump();
+
+#else
+
+// Compile to nothing when tracing is disabled
+#define TRACE(event, param, value) do {} while( 0 )
+
+#endif
+
+#endif //TRACE_H